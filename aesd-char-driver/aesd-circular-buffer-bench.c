@@ -0,0 +1,313 @@
+/*
+ * aesd-circular-buffer-bench.c
+ *
+ * Userspace microbenchmark for the circular buffer, built from the same
+ * aesd-circular-buffer.c the driver uses. For each depth, entry size and
+ * entry count it fills a buffer with writes of 1 to entry_bytes bytes, each
+ * with its own storage, and times:
+ *   find   - aesd_circular_buffer_find_entry_offset_for_fpos() at random positions
+ *   linear - the linear walk over the entries find replaced, as a baseline
+ *   iterate - copying every entry out oldest first, what a full dump does
+ *   add    - aesd_circular_buffer_add_entry(), dropping the oldest entry as well
+ *            while the buffer is not full so the entry count stays the same
+ * Every find is checked against the linear walk before timing.
+ *
+ * Cache misses come from a perf_event hardware counter on this thread, user
+ * space only. Where perf_event_open() is not allowed (perf_event_paranoid,
+ * containers, virtual machines without a PMU) the column is left empty.
+ *
+ * Prints one CSV row per operation, depth, entry size and entry count.
+ *
+ * Usage: aesd-circular-buffer-bench [-d depth[,depth...]] [-s entry_bytes[,entry_bytes...]]
+ *                                   [-e entries[,entries...]] [-n ops]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aesd-circular-buffer.h"
+
+enum bench_op { OP_FIND, OP_LINEAR, OP_ITERATE, OP_ADD, OP_COUNT };
+static const char *const op_names[OP_COUNT] = { "find", "linear", "iterate", "add" };
+
+static int miss_fd = -1;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Count cache misses of this thread in user space, -1 when the kernel does not let us
+static int open_miss_counter(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void miss_start(void) {
+    if (miss_fd == -1) return;
+    ioctl(miss_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(miss_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// @return the misses since miss_start(), or -1 without a counter
+static long long miss_stop(void) {
+    long long count;
+
+    if (miss_fd == -1) return -1;
+    ioctl(miss_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(miss_fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+}
+
+// Parse a comma separated list of up to max numbers into list, @return how many
+static size_t parse_list(char *str, unsigned long *list, size_t max) {
+    size_t n = 0;
+
+    for (char *tok = strtok(str, ","); tok && n < max; tok = strtok(NULL, ",")) {
+        list[n++] = strtoul(tok, NULL, 10);
+    }
+    return n;
+}
+
+// The lookup before cumulative offsets: walk the entries from the oldest one
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                             size_t *entry_offset_byte_rtn) {
+    size_t count = aesd_circular_buffer_count(buffer), current_offset = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry =
+            &buffer->entry[(buffer->out_offs + i) & buffer->size_mask];
+        if (char_offset < current_offset + entry->size) {
+            *entry_offset_byte_rtn = char_offset - current_offset;
+            return entry;
+        }
+        current_offset += entry->size;
+    }
+    return NULL;
+}
+
+// The next write to add, of 1..entry_bytes bytes in slot n of pool, which has room for entries of them
+static struct aesd_buffer_entry make_entry(char *pool, size_t n, size_t entries, size_t entry_bytes,
+                                           unsigned int *seed) {
+    struct aesd_buffer_entry e = {
+        .buffptr = pool + (n % entries) * entry_bytes,
+        .size = 1 + rand_r(seed) % entry_bytes,
+    };
+    return e;
+}
+
+// Add entries writes, a full buffer is also wrapped so out_offs is not 0
+static void fill(struct aesd_circular_buffer *buffer, uint32_t depth, char *pool, size_t entries,
+                 size_t entry_bytes, unsigned int *seed) {
+    struct aesd_buffer_entry dropped;
+    size_t adds = entries >= depth ? entries + depth / 2 : entries;
+
+    while (aesd_circular_buffer_drop_oldest(buffer, &dropped)) {
+    }
+    for (size_t i = 0; i < adds; i++) {
+        struct aesd_buffer_entry e = make_entry(pool, i, entries, entry_bytes, seed);
+        aesd_circular_buffer_add_entry(buffer, &e);
+    }
+}
+
+/*
+ * Time ops operations of kind op on buffer, @return ns per operation and
+ * set *misses_rtn to the cache misses per operation, or -1 without a counter
+ */
+static double run_op(enum bench_op op, struct aesd_circular_buffer *buffer, const size_t *positions, long ops,
+                     char *pool, size_t entries, size_t entry_bytes, char *out, unsigned int *seed,
+                     double *misses_rtn) {
+    struct aesd_buffer_entry dropped;
+    size_t sink = 0, off;
+    long done = 0;
+    long long misses;
+    double start;
+
+    miss_start();
+    start = now_ns();
+    switch (op) {
+        case OP_FIND:
+        case OP_LINEAR:
+            for (; done < ops; done++) {
+                struct aesd_buffer_entry *e = op == OP_FIND ?
+                    aesd_circular_buffer_find_entry_offset_for_fpos(buffer, positions[done], &off) :
+                    linear_find(buffer, positions[done], &off);
+                sink += (size_t)(e - buffer->entry) + off;
+            }
+            break;
+        case OP_ITERATE:
+            // Whole dumps until at least ops entries were copied, counted per entry
+            while (done < ops) {
+                size_t count = aesd_circular_buffer_count(buffer), len = 0;
+
+                for (size_t i = 0; i < count; i++) {
+                    const struct aesd_buffer_entry *e =
+                        &buffer->entry[(buffer->out_offs + i) & buffer->size_mask];
+                    memcpy(out + len, e->buffptr, e->size);
+                    len += e->size;
+                }
+                sink += out[len / 2];
+                done += count;
+            }
+            break;
+        case OP_ADD:
+            for (; done < ops; done++) {
+                struct aesd_buffer_entry e = make_entry(pool, done, entries, entry_bytes, seed);
+                if (!buffer->full)
+                    aesd_circular_buffer_drop_oldest(buffer, &dropped);
+                aesd_circular_buffer_add_entry(buffer, &e);
+            }
+            sink += buffer->in_offs;
+            break;
+        default:
+            break;
+    }
+    double elapsed = now_ns() - start;
+    misses = miss_stop();
+
+    if (sink == 1) fprintf(stderr, " "); // Keep the work from being optimized away
+    *misses_rtn = misses < 0 ? -1 : (double)misses / done;
+    return elapsed / done;
+}
+
+/*
+ * Benchmark every entry count of entry_list no larger than depth
+ * @return 0, or -1 if a find disagreed with the linear walk or memory ran out
+ */
+static int bench_depth(uint32_t depth, const unsigned long *sizes, size_t nsizes, const unsigned long *entry_list,
+                       size_t nentries, long ops, unsigned int *seed) {
+    static struct aesd_circular_buffer buffer;
+    unsigned long defaults[16];
+    size_t *positions = malloc(ops * sizeof(*positions));
+    int ret = -1;
+
+    aesd_circular_buffer_init(&buffer);
+    if (!positions) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    if (aesd_circular_buffer_resize(&buffer, depth) != 0) {
+        fprintf(stderr, "Invalid depth %u\n", depth);
+        free(positions);
+        return -1;
+    }
+    if (!nentries) {
+        // Powers of 8 below the depth, and the full depth
+        for (unsigned long n = 8; n < depth && nentries < 15; n *= 8) defaults[nentries++] = n;
+        defaults[nentries++] = depth;
+        entry_list = defaults;
+    }
+
+    for (size_t s = 0; s < nsizes; s++) {
+        size_t entry_bytes = sizes[s];
+
+        for (size_t i = 0; i < nentries; i++) {
+            size_t entries = entry_list[i];
+            if (entries == 0 || entries > depth) continue;
+
+            char *pool = malloc(entries * entry_bytes), *out = malloc(entries * entry_bytes);
+            if (!pool || !out) {
+                fprintf(stderr, "Memory allocation failed for %zu entries of %zu bytes\n", entries, entry_bytes);
+                free(pool);
+                free(out);
+                goto out;
+            }
+            memset(pool, 'x', entries * entry_bytes);
+            fill(&buffer, depth, pool, entries, entry_bytes, seed);
+            size_t total = aesd_circular_buffer_size(&buffer);
+            for (long k = 0; k < ops; k++) {
+                positions[k] = rand_r(seed) % total;
+            }
+
+            for (long k = 0; k < ops && k < 10000; k++) {
+                size_t off_a = 0, off_b = 0;
+                struct aesd_buffer_entry *a = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, positions[k], &off_a);
+                struct aesd_buffer_entry *b = linear_find(&buffer, positions[k], &off_b);
+                if (a != b || off_a != off_b) {
+                    fprintf(stderr, "lookup mismatch at position %zu with %zu entries\n", positions[k], entries);
+                    free(pool);
+                    free(out);
+                    goto out;
+                }
+            }
+
+            // add goes last, it changes the contents the others look at
+            for (int op = 0; op < OP_COUNT; op++) {
+                double misses, ns = run_op(op, &buffer, positions, ops, pool, entries, entry_bytes, out, seed, &misses);
+
+                printf("%s,%u,%zu,%zu,%ld,%.1f,", op_names[op], depth, entries, entry_bytes, ops, ns);
+                if (misses >= 0) printf("%.3f", misses);
+                printf("\n");
+            }
+            fflush(stdout);
+            free(pool);
+            free(out);
+        }
+    }
+    ret = 0;
+out:
+    aesd_circular_buffer_free(&buffer);
+    free(positions);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    char default_depths[] = "16,256,4096", default_sizes[] = "16,256,2048";
+    char *depth_str = default_depths, *size_str = default_sizes, *entry_str = NULL;
+    unsigned long depths[16], sizes[16], entry_list[16];
+    size_t ndepths, nsizes, nentries = 0;
+    long ops = 1000000;
+    unsigned int seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:e:n:")) != -1) {
+        switch (opt) {
+            case 'd': depth_str = optarg; break;
+            case 's': size_str = optarg; break;
+            case 'e': entry_str = optarg; break;
+            case 'n': ops = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d depth[,depth...]] [-s entry_bytes[,entry_bytes...]] "
+                        "[-e entries[,entries...]] [-n ops]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (ops < 1) ops = 1;
+    ndepths = parse_list(depth_str, depths, 16);
+    nsizes = parse_list(size_str, sizes, 16);
+    if (entry_str) nentries = parse_list(entry_str, entry_list, 16);
+    for (size_t i = 0; i < nsizes; i++) {
+        if (sizes[i] == 0) sizes[i] = 1;
+    }
+
+    miss_fd = open_miss_counter();
+    if (miss_fd == -1)
+        fprintf(stderr, "No cache miss counter (%s), leaving the column empty\n", strerror(errno));
+
+    printf("op,depth,entries,entry_bytes,ops,ns_per_op,cache_misses_per_op\n");
+    for (size_t d = 0; d < ndepths; d++) {
+        if (bench_depth(depths[d], sizes, nsizes, nentries ? entry_list : NULL, nentries, ops, &seed) != 0) {
+            if (miss_fd != -1) close(miss_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (miss_fd != -1) close(miss_fd);
+    return EXIT_SUCCESS;
+}
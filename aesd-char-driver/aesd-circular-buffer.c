@@ -11,15 +11,93 @@
 #ifdef __KERNEL__
 #include <linux/string.h>
 #include <linux/slab.h>  // For kfree() in kernel space
+#include <linux/mm.h>    // kvmalloc_array(), slot arrays may be too large for kmalloc
+#include <linux/errno.h>
+#include <linux/compiler.h> // READ_ONCE(), WRITE_ONCE()
+#include <asm/barrier.h>
+#define slots_alloc(n, size) kvmalloc_array(n, size, GFP_KERNEL)
+#define slots_free(ptr) kvfree(ptr)
 #else
 #include <string.h>
 #include <stdlib.h>  // Needed for free()
+#include <errno.h>
+#define slots_alloc(n, size) calloc(n, size)
+#define slots_free(ptr) free(ptr)
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
 #endif
 
 #include "aesd-circular-buffer.h"
 
 /**
- * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
+ * @return the slot holding the entry @param index places after the oldest one
+ */
+static inline uint32_t slot_for_index(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return (buffer->out_offs + index) & buffer->size_mask;
+}
+
+/**
+ * @return the number of entries stored in @param buffer
+ */
+size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return buffer->depth;
+    return (buffer->in_offs - buffer->out_offs) & buffer->size_mask;
+}
+
+/**
+ * The fields a lookup uses, each read once. Lookups may run without the
+ * writers' lock (the driver retries them with a sequence count if a writer
+ * got in the way), so the buffer can change half way through reading it.
+ * The mask is read before the slot arrays and a resize publishes them in the
+ * opposite order, and slot storage never shrinks, so the slots a torn view
+ * points at are always in bounds even when the answer is wrong.
+ */
+struct buffer_view
+{
+    const struct aesd_buffer_entry *entry;
+    const size_t *entry_start;
+    uint32_t size_mask;
+    uint32_t out_offs;
+    size_t base_offs;
+    size_t total_size;
+    uint64_t out_seq;
+    uint32_t count;
+};
+
+static void buffer_view(const struct aesd_circular_buffer *buffer, struct buffer_view *view)
+{
+    view->size_mask = READ_ONCE(buffer->size_mask);
+    smp_rmb(); // Arrays at least as large as the mask, see aesd_circular_buffer_commit_resize()
+    view->entry = READ_ONCE(buffer->entry);
+    view->entry_start = READ_ONCE(buffer->entry_start);
+    view->out_offs = READ_ONCE(buffer->out_offs);
+    view->base_offs = READ_ONCE(buffer->base_offs);
+    view->total_size = READ_ONCE(buffer->total_size);
+    view->out_seq = READ_ONCE(buffer->out_seq);
+    if (READ_ONCE(buffer->full))
+        view->count = READ_ONCE(buffer->depth);
+    else
+        view->count = (READ_ONCE(buffer->in_offs) - view->out_offs) & view->size_mask;
+}
+
+static inline uint32_t view_slot(const struct buffer_view *view, uint32_t index)
+{
+    return (view->out_offs + index) & view->size_mask;
+}
+
+static inline size_t view_fpos(const struct buffer_view *view, uint32_t slot)
+{
+    return view->entry_start[slot] - view->base_offs;
+}
+
+/**
+ * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller,
+ *      or the result validated afterwards, see struct buffer_view.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
  *      character index if all buffer strings were concatenated end to end
  * @param entry_offset_byte_rtn is a pointer specifying a location to store the byte of the returned aesd_buffer_entry
@@ -31,28 +109,111 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-//     size_t total_size = 0;
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
+    struct buffer_view view;
+    uint32_t low = 0, high, slot;
 
-    size_t current_offset = 0;
-    
-    // Iterate again to find the correct entry
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) //starts from out_offs
-    {
-        if (entry->buffptr == NULL)
-            continue;
+    buffer_view(buffer, &view);
+    if (char_offset >= view.total_size || view.count == 0)
+        return NULL; // Not enough data written
 
-        if (char_offset < current_offset + entry->size)
-        {
-            *entry_offset_byte_rtn = char_offset - current_offset;
-            return entry;
-        }
+    // Binary search for the last entry starting at or before char_offset,
+    // the entry offsets grow from the oldest entry to the newest
+    high = view.count - 1;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
 
-        current_offset += entry->size;
+        if (view_fpos(&view, view_slot(&view, mid)) <= char_offset)
+            low = mid;
+        else
+            high = mid - 1;
     }
 
-    return NULL; // Should never reach here if logic is correct
+    slot = view_slot(&view, low);
+    *entry_offset_byte_rtn = char_offset - view_fpos(&view, slot);
+    return (struct aesd_buffer_entry *)&view.entry[slot];
+}
+
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller,
+ *      or the result validated afterwards, see struct buffer_view.
+ * @param entry_index the zero referenced entry, counting from the oldest one still stored
+ * @param entry_offset the byte within that entry
+ * @param fpos_rtn is set to the position of that byte if all buffer strings were concatenated
+ *      end to end
+ * @return true if the entry exists and holds more than @param entry_offset bytes
+ */
+bool aesd_circular_buffer_fpos_for_entry(const struct aesd_circular_buffer *buffer,
+            uint32_t entry_index, size_t entry_offset, size_t *fpos_rtn)
+{
+    struct buffer_view view;
+    uint32_t slot;
+
+    buffer_view(buffer, &view);
+    if (entry_index >= view.count)
+        return false;
+
+    slot = view_slot(&view, entry_index);
+    if (entry_offset >= READ_ONCE(view.entry[slot].size))
+        return false;
+
+    *fpos_rtn = view_fpos(&view, slot) + entry_offset;
+    return true;
+}
+
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller,
+ *      or the result validated afterwards, see struct buffer_view.
+ * @param seq the sequence number of the entry to find, see out_seq in struct aesd_circular_buffer
+ * @param fpos_rtn is set to the position of the first byte of that entry if all buffer strings
+ *      were concatenated end to end, or of the oldest entry stored if it was overwritten already,
+ *      or to the end if it is the next entry to be added
+ * @param seq_rtn is set to the sequence number of the entry at @param fpos_rtn
+ * @return false if @param seq is past the next entry to be added
+ */
+bool aesd_circular_buffer_fpos_for_seq(const struct aesd_circular_buffer *buffer,
+            uint64_t seq, size_t *fpos_rtn, uint64_t *seq_rtn)
+{
+    struct buffer_view view;
+
+    buffer_view(buffer, &view);
+    if (seq < view.out_seq)
+        seq = view.out_seq; // Overwritten, continue from the oldest
+    if (seq - view.out_seq > view.count)
+        return false;
+
+    *fpos_rtn = seq - view.out_seq == view.count ? view.total_size :
+                view_fpos(&view, view_slot(&view, seq - view.out_seq));
+    *seq_rtn = seq;
+    return true;
+}
+
+/**
+ * @param buffer the buffer to describe.  Any necessary locking must be performed by caller,
+ *      or the result validated afterwards, see struct buffer_view.
+ * @param first the zero referenced entry to start at, counting from the oldest one still stored
+ * @param max the most entries to describe
+ * @param fpos_rtn is set to the position of the first byte of each entry described, if all buffer
+ *      strings were concatenated end to end, and must have room for @param max of them
+ * @param size_rtn is set to the size of each entry described, with room for @param max of them
+ * @return the number of entries described, 0 if @param first is not stored
+ */
+uint32_t aesd_circular_buffer_entry_table(const struct aesd_circular_buffer *buffer,
+            uint32_t first, uint32_t max, size_t *fpos_rtn, size_t *size_rtn)
+{
+    struct buffer_view view;
+    uint32_t i, slot;
+
+    buffer_view(buffer, &view);
+    if (first >= view.count)
+        return 0;
+
+    for (i = 0; i < max && i < view.count - first; i++) {
+        slot = view_slot(&view, first + i);
+        fpos_rtn[i] = view_fpos(&view, slot);
+        size_rtn[i] = READ_ONCE(view.entry[slot].size);
+    }
+    return i;
 }
 
 /**
@@ -65,30 +226,198 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     
-   // If the buffer is full, we are about to overwrite the oldest entry
+    // If the buffer is full, we are about to overwrite the oldest entry
     if (buffer->full)
     {
+        // Drop its bytes, the contents now start at the next entry
+        buffer->base_offs += buffer->entry[buffer->out_offs].size;
+        buffer->total_size -= buffer->entry[buffer->out_offs].size;
+
+        // With more slots than depth the oldest slot is not overwritten, leave it empty
+        buffer->entry[buffer->out_offs].buffptr = NULL;
+        buffer->entry[buffer->out_offs].size = 0;
+
         // Advance out_offs first, before writing the new entry
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = (buffer->out_offs + 1) & buffer->size_mask;
+        buffer->out_seq++;
     }
 
-    // Copy the new entry into the buffer at in_offs
+    // Copy the new entry into the buffer at in_offs, it starts at the current end
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_start[buffer->in_offs] = buffer->base_offs + buffer->total_size;
+    buffer->total_size += add_entry->size;
 
     // Move in_offs forward to the next available spot
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->size_mask;
 
-    // If the buffer is now full, set the flag
-    if (buffer->in_offs == buffer->out_offs)
+    // If the buffer now holds depth entries, set the flag
+    if (((buffer->in_offs - buffer->out_offs) & buffer->size_mask) == (buffer->depth & buffer->size_mask))
     {
         buffer->full = true;
     }
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry from @param buffer and stores it in @param dropped, so the caller
+* can release the memory it references.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer was empty
+*/
+bool aesd_circular_buffer_drop_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *dropped)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+
+    if (aesd_circular_buffer_count(buffer) == 0)
+        return false;
+
+    *dropped = *oldest;
+    buffer->base_offs += oldest->size;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->size_mask;
+    buffer->out_seq++;
+    buffer->full = false;
+    return true;
+}
+
+/**
+* Prepares to change @param buffer to keep the @param depth most recent writes, allocating
+* slot storage for depth rounded up to a power of two into @param slots unless the current
+* storage is large enough, in which case slots->entry is NULL. Storage never shrinks, see
+* struct buffer_view. The buffer must not hold more than depth entries by the time
+* aesd_circular_buffer_commit_resize() finishes the change, drop the oldest ones first with
+* aesd_circular_buffer_drop_oldest(). The buffer itself is not changed, so only
+* aesd_circular_buffer_commit_resize() needs to exclude lockless readers.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, -EINVAL for a depth of 0 or above AESDCHAR_MAX_DEPTH or smaller than
+* the number of stored entries, -ENOMEM if the storage can not be allocated
+*/
+int aesd_circular_buffer_prepare_resize(const struct aesd_circular_buffer *buffer, uint32_t depth,
+            struct aesd_circular_buffer_slots *slots)
+{
+    uint32_t size = 1;
+
+    slots->entry = NULL;
+    slots->entry_start = NULL;
+    if (depth == 0 || depth > AESDCHAR_MAX_DEPTH || depth < aesd_circular_buffer_count(buffer))
+        return -EINVAL;
+
+    while (size < depth)
+        size <<= 1;
+    if (size <= buffer->size_mask + 1)
+        return 0;
+
+    slots->entry = slots_alloc(size, sizeof(*slots->entry));
+    slots->entry_start = slots_alloc(size, sizeof(*slots->entry_start));
+    slots->size_mask = size - 1;
+    if (!slots->entry || !slots->entry_start)
+    {
+        aesd_circular_buffer_free_slots(slots);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+* Finishes the change aesd_circular_buffer_prepare_resize() started. The stored entries and
+* their positions are unchanged. @param slots is left holding the storage replaced, for the
+* caller to release with aesd_circular_buffer_free_slots() once no lockless reader can use it.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_commit_resize(struct aesd_circular_buffer *buffer, uint32_t depth,
+            struct aesd_circular_buffer_slots *slots)
+{
+    size_t count = aesd_circular_buffer_count(buffer);
+    struct aesd_buffer_entry *old_entry = buffer->entry;
+    size_t *old_entry_start = buffer->entry_start;
+    uint32_t i;
+
+    if (slots->entry)
+    {
+        // Move the stored entries to the start of the new slots, oldest first
+        for (i = 0; i < count; i++)
+        {
+            uint32_t slot = slot_for_index(buffer, i);
+
+            slots->entry[i] = buffer->entry[slot];
+            slots->entry_start[i] = buffer->entry_start[slot];
+        }
+        for (; i <= slots->size_mask; i++)
+        {
+            slots->entry[i].buffptr = NULL;
+            slots->entry[i].size = 0;
+        }
+        WRITE_ONCE(buffer->entry, slots->entry);
+        WRITE_ONCE(buffer->entry_start, slots->entry_start);
+        smp_wmb(); // Larger arrays before the mask that indexes them, see struct buffer_view
+        WRITE_ONCE(buffer->size_mask, slots->size_mask);
+        buffer->out_offs = 0;
+        buffer->in_offs = count & buffer->size_mask;
+
+        // Hand the old storage back, the embedded one is not released
+        slots->entry = old_entry == buffer->entry_storage ? NULL : old_entry;
+        slots->entry_start = old_entry == buffer->entry_storage ? NULL : old_entry_start;
+    }
+
+    buffer->depth = depth;
+    buffer->full = count == depth;
+}
+
+/**
+* Changes @param buffer to keep the @param depth most recent writes, see
+* aesd_circular_buffer_prepare_resize(). For callers without lockless readers.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, or the error aesd_circular_buffer_prepare_resize() returns
+*/
+int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t depth)
+{
+    struct aesd_circular_buffer_slots slots;
+    int retval = aesd_circular_buffer_prepare_resize(buffer, depth, &slots);
+
+    if (retval)
+        return retval;
+    aesd_circular_buffer_commit_resize(buffer, depth, &slots);
+    aesd_circular_buffer_free_slots(&slots);
+    return 0;
+}
+
+/**
+* Releases slot storage handed out by aesd_circular_buffer_prepare_resize() or
+* aesd_circular_buffer_commit_resize()
+*/
+void aesd_circular_buffer_free_slots(struct aesd_circular_buffer_slots *slots)
+{
+    slots_free(slots->entry);
+    slots_free(slots->entry_start);
+    slots->entry = NULL;
+    slots->entry_start = NULL;
+}
+
+/**
+* Releases slot storage allocated by aesd_circular_buffer_resize(), the memory the entries
+* reference is up to the caller. The buffer must be initialized again before further use.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->entry != buffer->entry_storage)
+    {
+        slots_free(buffer->entry);
+        slots_free(buffer->entry_start);
+    }
+    buffer->entry = NULL;
+    buffer->entry_start = NULL;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct, keeping
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes in the embedded storage
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->entry_storage;
+    buffer->entry_start = buffer->entry_start_storage;
+    buffer->size_mask = AESDCHAR_EMBEDDED_SLOTS - 1;
+    buffer->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
@@ -16,7 +16,18 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of writes kept, aesd_circular_buffer_resize() changes it
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Slots stored inside struct aesd_circular_buffer, the default depth rounded up to a power of two
+ */
+#define AESDCHAR_EMBEDDED_SLOTS 16
+/**
+ * Largest depth aesd_circular_buffer_resize() accepts
+ */
+#define AESDCHAR_MAX_DEPTH (1U << 20)
 
 struct aesd_buffer_entry
 {
@@ -33,22 +44,67 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * size_mask + 1 slots of which at most depth are in use
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Running byte count at which each entry starts, as if every write ever
+     * added had been concatenated. Subtracting base_offs gives the entry's
+     * offset in the current contents, which grows with the entry index so it
+     * can be binary searched. Wraps around harmlessly, only differences are used.
+     */
+    size_t *entry_start;
+    /**
+     * Number of slots minus one, the slot count is a power of two so indexes wrap with a mask
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t size_mask;
+    /**
+     * Number of writes kept before the oldest is overwritten
+     */
+    uint32_t depth;
+    /**
+     * Running byte count at which the entry at out_offs starts
+     */
+    size_t base_offs;
+    /**
+     * Sequence number of the entry at out_offs. Entries are numbered from 0 in the
+     * order they are added, so a number keeps naming the same write as older ones go.
+     */
+    uint64_t out_seq;
+    /**
+     * Total number of bytes stored in all entries
+     */
+    size_t total_size;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Storage used until aesd_circular_buffer_resize() allocates a larger size
+     */
+    struct aesd_buffer_entry entry_storage[AESDCHAR_EMBEDDED_SLOTS];
+    size_t entry_start_storage[AESDCHAR_EMBEDDED_SLOTS];
+};
+
+/**
+ * Slot storage on its way into or out of a struct aesd_circular_buffer, see
+ * aesd_circular_buffer_prepare_resize()
+ */
+struct aesd_circular_buffer_slots
+{
+    struct aesd_buffer_entry *entry;
+    size_t *entry_start;
+    uint32_t size_mask;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -58,12 +114,47 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t depth);
+
+extern int aesd_circular_buffer_prepare_resize(const struct aesd_circular_buffer *buffer, uint32_t depth,
+            struct aesd_circular_buffer_slots *slots);
+
+extern void aesd_circular_buffer_commit_resize(struct aesd_circular_buffer *buffer, uint32_t depth,
+            struct aesd_circular_buffer_slots *slots);
+
+extern void aesd_circular_buffer_free_slots(struct aesd_circular_buffer_slots *slots);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_drop_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *dropped);
+
+extern size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_fpos_for_entry(const struct aesd_circular_buffer *buffer,
+            uint32_t entry_index, size_t entry_offset, size_t *fpos_rtn);
+
+extern bool aesd_circular_buffer_fpos_for_seq(const struct aesd_circular_buffer *buffer,
+            uint64_t seq, size_t *fpos_rtn, uint64_t *seq_rtn);
+
+extern uint32_t aesd_circular_buffer_entry_table(const struct aesd_circular_buffer *buffer,
+            uint32_t first, uint32_t max, size_t *fpos_rtn, size_t *size_rtn);
+
+/**
+ * @return the number of bytes stored in @param buffer, which is also the end of file position
+ */
+static inline size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
- * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Useful when you've allocated memory for circular buffer entries and need to free it.
+ * Slots not in use have a NULL buffptr.
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a stack allocated value used by this macro for an index, wide enough
+ *      to count every slot (uint8_t is enough for the default depth)
  * Example usage:
  * uint8_t index;
  * struct aesd_circular_buffer buffer;
@@ -73,9 +164,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[(index+buffer->out_offs)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[(index+buffer->out_offs)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]))
+    for(index=0, entryptr=&((buffer)->entry[(index+(buffer)->out_offs)&(buffer)->size_mask]); \
+            index<=(buffer)->size_mask; \
+            index++, entryptr=&((buffer)->entry[(index+(buffer)->out_offs)&(buffer)->size_mask]))
 /*
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index) \
     for (index = buffer->out_offs, entryptr = &((buffer)->entry[index]); \
@@ -33,14 +33,131 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One user space buffer of a batched call. Unlike struct iovec it has the same layout for
+ * 32 and 64 bit callers.
+ */
+struct aesd_iovec {
+    uint64_t base;             // Pointer to the buffer
+    uint64_t len;
+};
+
+/**
+ * AESDCHAR_IOCREADCMDS: seek to a write command like AESDCHAR_IOCSEEKTO and read what follows
+ * into several buffers, all in one call. The file position is left after the bytes returned.
+ * User space pointers are passed as uint64_t, so 32 bit callers use the same layout.
+ */
+struct aesd_read_cmds {
+    uint32_t write_cmd;        // The zero referenced write command to start at
+    uint32_t write_cmd_offset; // The zero referenced offset within it
+    uint32_t cmd_count;        // Write commands to read up to the end of, 0 for all that are stored
+    uint32_t iovcnt;           // Number of buffers, at most UIO_MAXIOV
+    uint64_t iov;              // struct aesd_iovec[iovcnt], filled in turn
+    uint64_t bytes;            // Set to the number of bytes returned
+};
+
+/**
+ * One write command as AESDCHAR_IOCENTRIES describes it
+ */
+struct aesd_entry_info {
+    uint64_t offset;           // File position of its first byte
+    uint64_t size;
+    uint64_t seq;              // Sequence number, see struct aesd_seekseq
+    uint64_t start;            // Global byte offset of its first byte, 0 on the merged view
+};
+
+/**
+ * AESDCHAR_IOCENTRIES: the file position and size of a run of write commands, all taken at
+ * the same time so they add up.
+ */
+struct aesd_entry_table {
+    uint32_t first_cmd;        // The zero referenced write command to start at
+    uint32_t max_entries;      // Room in entries
+    uint64_t entries;          // struct aesd_entry_info[max_entries]
+    uint32_t count;            // Set to the number of entries filled
+    uint32_t total_cmds;       // Set to the number of write commands stored
+    uint64_t total_size;       // Set to the number of bytes stored
+};
+
+/**
+ * AESDCHAR_IOCWRITELINES: store several lines in one call, each buffer holding one line that
+ * ends in '\n', as if each had been written in turn. A line the file has left unfinished is
+ * completed by the first one.
+ */
+struct aesd_write_lines {
+    uint64_t iov;              // struct aesd_iovec[iovcnt], one line each
+    uint32_t iovcnt;           // At most UIO_MAXIOV
+    uint32_t lines;            // Set to the number of lines stored, also when an error stops it
+};
+
+/**
+ * AESDCHAR_IOCSEEKSEQ: seek to a write by its sequence number. Unlike write command indexes
+ * and file positions, which shift whenever the oldest write is overwritten, a sequence number
+ * names the same write for good: writes are numbered from 0 in the order they are stored, per
+ * device, or across all CPUs on the merged view of per CPU mode. A reader that remembers the
+ * number after the last write it read resumes there and learns what it missed.
+ */
+struct aesd_seekseq {
+    uint64_t seq;              // In: the write to seek to. Out: the one sought to, the oldest
+                               // still stored if seq was overwritten, or seq if nothing is
+                               // stored from it on yet
+    uint64_t offset;           // Out: global byte offset of that write, the running count of
+                               // bytes ever stored, 0 on the merged view. The bytes lost are
+                               // offset minus the global byte offset where the reader stopped.
+    uint64_t lost;             // Out: writes overwritten before they could be read, seq out - seq in
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Change the number of writes the device keeps, the oldest ones are dropped when shrinking
+#define AESDCHAR_IOCRESIZE _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Non zero: reads at the end wait for the next write like tail -f (or fail with EAGAIN on a
+// non blocking file) and never return 0, and continue where the previous read stopped even
+// when evictions shift the file positions. Not available on the merged view of per CPU mode.
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 3, uint32_t)
+// Batched calls, see the structures above
+#define AESDCHAR_IOCREADCMDS _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_cmds)
+#define AESDCHAR_IOCENTRIES _IOWR(AESD_IOC_MAGIC, 5, struct aesd_entry_table)
+#define AESDCHAR_IOCWRITELINES _IOWR(AESD_IOC_MAGIC, 6, struct aesd_write_lines)
+// Seek by sequence number, fails with EINVAL for a number not given out yet
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 7, struct aesd_seekseq)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
+
+/**
+ * Read only mapping of the byte ring (driver loaded with ring_bytes set). The mapping
+ * starts with struct aesd_mmap_header, the ring data follows at header_size.
+ *
+ * Positions are running byte counts over every write ever made, the byte at position p is
+ * at data[p & (ring_size - 1)]. To read consistently, load seq and wait while it is odd,
+ * copy the fields needed, then load seq again and retry if it changed. Bytes read from the
+ * ring are only valid if tail has not passed them once they have been used, so check tail
+ * again (the same way) afterwards.
+ */
+#define AESD_MMAP_MAGIC 0x41455344 // "AESD"
+#define AESD_MMAP_INDEX_SLOTS 4096
+
+struct aesd_mmap_entry {
+    uint64_t start; // Position of the first byte of the write
+    uint64_t size;
+};
+
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t header_size;  // Bytes before the ring data, a multiple of the page size
+    uint64_t ring_size;    // Power of two
+    uint32_t index_slots;  // Writes the index below holds
+    uint32_t seq;          // Odd while the driver updates the fields below
+    uint64_t tail;         // Position of the oldest byte still stored
+    uint64_t head;         // Position one past the newest byte
+    uint64_t first_entry;  // Number of the oldest write in the index
+    uint64_t next_entry;   // Number the next write will get
+    struct aesd_mmap_entry index[AESD_MMAP_INDEX_SLOTS]; // Write n is index[n % index_slots]
+};
 
 #endif /* AESD_IOCTL_H */
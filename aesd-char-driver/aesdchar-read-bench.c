@@ -0,0 +1,162 @@
+/*
+ * aesdchar-read-bench.c
+ *
+ * Full buffer dump benchmark for /dev/aesdchar. Optionally stores a number of
+ * lines first, then reads the whole device from the start again and again
+ * with each of the given buffer sizes, like cat or aesdsocket replying. Counts
+ * the read() calls one dump takes, which is the syscall and lock round trip
+ * count that multi-entry reads bring down, and the dump throughput.
+ *
+ * With -t the lines stored are timestamp records like aesdsocket's instead
+ * of one repeated letter. Where debugfs aesdchar/alloc is readable the bytes
+ * the driver holds allocated are reported too, so loading it with and
+ * without compress_block compares memory use against dump time.
+ *
+ * Prints one CSV row per buffer size.
+ *
+ * Usage: aesdchar-read-bench [-f device] [-w lines] [-l line_bytes] [-t] [-b bufsize[,bufsize...]] [-n dumps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+static const char *alloc_path = "/sys/kernel/debug/aesdchar/alloc";
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Store lines of line_bytes bytes, each with its own write like aesdsocket does
+static int fill(const char *path, long lines, int line_bytes, int timestamps) {
+    char *line = malloc(line_bytes + 1);
+    int fd = open(path, O_WRONLY);
+    time_t t = time(NULL);
+    int ret = -1;
+
+    if (!line || fd == -1) goto out;
+    memset(line, 'x', line_bytes - 1);
+    line[line_bytes - 1] = '\n';
+    for (long i = 0; i < lines; i++) {
+        if (timestamps) {
+            // One every 10 seconds, padded or cut to line_bytes
+            time_t when = t + i * 10;
+            struct tm tm;
+            int n = strftime(line, line_bytes + 1, "timestamp:%a, %d %b %Y %T %z", localtime_r(&when, &tm));
+            memset(line + n, ' ', line_bytes - n);
+            line[line_bytes - 1] = '\n';
+        }
+        if (write(fd, line, line_bytes) != line_bytes) goto out;
+    }
+    ret = 0;
+out:
+    if (fd != -1) close(fd);
+    free(line);
+    return ret;
+}
+
+// @return the live_bytes debugfs reports, or -1 if it cannot be read
+static long long driver_bytes(void) {
+    FILE *f = fopen(alloc_path, "r");
+    char row[256];
+    long long bytes = -1;
+
+    if (!f) return -1;
+    while (fgets(row, sizeof(row), f)) {
+        if (sscanf(row, "live_bytes %lld", &bytes) == 1) break;
+    }
+    fclose(f);
+    return bytes;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "/dev/aesdchar";
+    char default_bufs[] = "1024,65536,1048576";
+    char *buf_list = default_bufs;
+    long lines = 0, dumps = 100;
+    int line_bytes = 64, timestamps = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:w:l:tb:n:")) != -1) {
+        switch (opt) {
+            case 'f': path = optarg; break;
+            case 'w': lines = atol(optarg); break;
+            case 'l': line_bytes = atoi(optarg); break;
+            case 't': timestamps = 1; break;
+            case 'b': buf_list = optarg; break;
+            case 'n': dumps = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f device] [-w lines] [-l line_bytes] [-t] [-b bufsize[,bufsize...]] "
+                        "[-n dumps]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (line_bytes < 1) line_bytes = 1;
+    if (dumps < 1) dumps = 1;
+
+    if (lines > 0 && fill(path, lines, line_bytes, timestamps) == -1) {
+        fprintf(stderr, "Failed to fill %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    long long held = driver_bytes();
+
+    printf("buf_bytes,dumps,bytes_per_dump,reads_per_dump,us_per_dump,mb_per_sec,driver_bytes\n");
+    for (char *tok = strtok(buf_list, ","); tok; tok = strtok(NULL, ",")) {
+        size_t buf_size = strtoul(tok, NULL, 10);
+        char *buf = buf_size ? malloc(buf_size) : NULL;
+        unsigned long long reads = 0, bytes = 0;
+
+        if (!buf) {
+            fprintf(stderr, "Bad buffer size %s\n", tok);
+            continue;
+        }
+
+        double start = now_us();
+        for (long d = 0; d < dumps; d++) {
+            ssize_t n;
+
+            if (lseek(fd, 0, SEEK_SET) == -1) {
+                fprintf(stderr, "lseek failed: %s\n", strerror(errno));
+                free(buf);
+                close(fd);
+                return EXIT_FAILURE;
+            }
+            // The read that returns 0 at the end counts too, cat makes it as well
+            do {
+                n = read(fd, buf, buf_size);
+                reads++;
+                if (n > 0) bytes += n;
+            } while (n > 0);
+            if (n == -1) {
+                fprintf(stderr, "read failed: %s\n", strerror(errno));
+                free(buf);
+                close(fd);
+                return EXIT_FAILURE;
+            }
+        }
+        double elapsed = now_us() - start;
+
+        printf("%zu,%ld,%llu,%.1f,%.1f,%.1f,", buf_size, dumps, bytes / dumps, (double)reads / dumps,
+               elapsed / dumps, bytes / elapsed);
+        if (held >= 0) printf("%lld", held);
+        printf("\n");
+        fflush(stdout);
+        free(buf);
+    }
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
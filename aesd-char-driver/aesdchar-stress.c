@@ -0,0 +1,194 @@
+/*
+ * aesdchar-stress.c
+ *
+ * Many reader stress test for /dev/aesdchar. Writer threads store numbered
+ * lines, some of them split over two writes, each through its own open file
+ * so the pieces of different writers' lines must not mix, while reader threads
+ * dump the device from the start over and over. Every complete line a read
+ * returns is checked against what was written, so a read that sees a write
+ * half updated or freed under it fails the test, and the dumps per second
+ * are reported for each reader thread count. Readers take no lock in the
+ * driver, so the dump rate should grow with the reader threads up to the
+ * core count instead of staying flat.
+ *
+ * Prints one CSV row per reader thread count, exits non zero on a bad line.
+ *
+ * Usage: aesdchar-stress [-f device] [-t threads[,threads...]] [-w writers] [-s seconds] [-b bufsize]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+static const char *path = "/dev/aesdchar";
+static size_t buf_size = 65536;
+static long nwriters = 1;
+static atomic_int stop;
+static atomic_int failed;
+
+struct reader {
+    pthread_t thread;
+    unsigned long long dumps;
+    unsigned long long bytes;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Line number seq is "<seq>:" followed by 1 to 150 letters that depend on seq
+static size_t make_line(char *buf, unsigned long seq) {
+    int n = sprintf(buf, "%lu:", seq);
+    size_t len = 1 + seq % 150;
+
+    for (size_t i = 0; i < len; i++) buf[n + i] = 'a' + (seq + i) % 26;
+    buf[n + len] = '\n';
+    return n + len + 1;
+}
+
+// Check every complete line in a read, the first one may have started in an earlier read
+static int check_chunk(const char *buf, size_t len) {
+    const char *p = memchr(buf, '\n', len), *end = buf + len;
+    char expected[200];
+
+    if (!p) return 0;
+    for (p++; p < end;) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        size_t n = make_line(expected, strtoul(p, NULL, 10));
+        if (n != (size_t)(nl - p + 1) || memcmp(expected, p, n) != 0) {
+            fprintf(stderr, "Bad line: %.*s\n", (int)(nl - p), p);
+            return -1;
+        }
+        p = nl + 1;
+    }
+    return 0;
+}
+
+// Writer id stores lines id, id + nwriters, id + 2 * nwriters...
+static void *writer_thread(void *arg) {
+    long id = (long)arg;
+    int fd = open(path, O_WRONLY);
+    char line[200];
+
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        atomic_store(&failed, 1);
+        return NULL;
+    }
+    for (unsigned long seq = id; !atomic_load(&stop); seq += nwriters) {
+        size_t n = make_line(line, seq), split = seq % 5 == 0 ? 1 + seq % (n - 1) : n;
+
+        if (write(fd, line, split) != (ssize_t)split ||
+            (split < n && write(fd, line + split, n - split) != (ssize_t)(n - split))) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            atomic_store(&failed, 1);
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    struct reader *r = arg;
+    char *buf = malloc(buf_size);
+    int fd = open(path, O_RDONLY);
+
+    if (!buf || fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        atomic_store(&failed, 1);
+        goto out;
+    }
+    while (!atomic_load(&stop)) {
+        ssize_t n;
+
+        if (lseek(fd, 0, SEEK_SET) == -1) break;
+        while ((n = read(fd, buf, buf_size)) > 0) {
+            r->bytes += n;
+            if (check_chunk(buf, n) == -1) {
+                atomic_store(&failed, 1);
+                goto out;
+            }
+        }
+        if (n == -1) {
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            atomic_store(&failed, 1);
+            break;
+        }
+        r->dumps++;
+    }
+out:
+    if (fd != -1) close(fd);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    char default_threads[] = "1,2,4,8";
+    char *thread_list = default_threads;
+    double seconds = 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:w:s:b:")) != -1) {
+        switch (opt) {
+            case 'f': path = optarg; break;
+            case 't': thread_list = optarg; break;
+            case 'w': nwriters = atol(optarg); break;
+            case 's': seconds = atof(optarg); break;
+            case 'b': buf_size = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f device] [-t threads[,threads...]] [-w writers] [-s seconds] [-b bufsize]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (buf_size < 1) buf_size = 1;
+    if (nwriters < 1) nwriters = 1;
+    pthread_t *writers = calloc(nwriters, sizeof(*writers));
+    if (!writers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("readers,writers,seconds,dumps_per_sec,mb_per_sec\n");
+    for (char *tok = strtok(thread_list, ","); tok && !atomic_load(&failed); tok = strtok(NULL, ",")) {
+        int nreaders = atoi(tok);
+        struct reader *readers = calloc(nreaders > 0 ? nreaders : 1, sizeof(*readers));
+        unsigned long long dumps = 0, bytes = 0;
+
+        if (nreaders < 1 || !readers) {
+            free(readers);
+            continue;
+        }
+        atomic_store(&stop, 0);
+        for (long i = 0; i < nwriters; i++) pthread_create(&writers[i], NULL, writer_thread, (void *)i);
+        for (int i = 0; i < nreaders; i++) pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+
+        double start = now_s();
+        usleep((useconds_t)(seconds * 1e6));
+        atomic_store(&stop, 1);
+        for (int i = 0; i < nreaders; i++) {
+            pthread_join(readers[i].thread, NULL);
+            dumps += readers[i].dumps;
+            bytes += readers[i].bytes;
+        }
+        for (long i = 0; i < nwriters; i++) pthread_join(writers[i], NULL);
+        double elapsed = now_s() - start;
+
+        printf("%d,%ld,%.1f,%.1f,%.1f\n", nreaders, nwriters, elapsed, dumps / elapsed, bytes / elapsed / 1e6);
+        fflush(stdout);
+        free(readers);
+    }
+
+    free(writers);
+    return atomic_load(&failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,9 +10,14 @@
 
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/srcu.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -27,18 +32,69 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/*
+ * Buckets of the partial write histogram, bucket n counts lines assembled
+ * from pieces totalling 2^(n-1) to 2^n - 1 bytes, the last one everything larger
+ */
+#define AESD_PARTIAL_HIST 16
+
+/*
+ * Counters of one device on one CPU, summed in debugfs aesdchar/<minor>/stats
+ */
+struct aesd_stats
+{
+    u64 read_ops;
+    u64 read_bytes;
+    u64 write_ops;
+    u64 write_bytes;
+    u64 evictions;
+    u64 lock_acquires;                     /* Of dev->lock by writers */
+    u64 lock_wait_ns;
+    u64 lock_hold_ns;
+    u64 partial_hist[AESD_PARTIAL_HIST];
+};
+
 struct aesd_dev
 {
     struct cdev cdev;                     /* Char device structure */
     struct aesd_circular_buffer circular_buffer;   /* Circular buffer for storing write operations */
-    struct mutex lock;                     /* Mutex for thread safety */
-    char *partial_write;                   /* Buffer for incomplete write operations */
+    struct mutex lock;                     /* Serializes writers, readers take no lock */
+    seqcount_mutex_t seq;                  /* Odd while a writer changes circular_buffer, lookups then retry */
+    struct aesd_write_buf *partial_write;  /* Line a file was closed in the middle of, the next write continues it */
     size_t partial_write_size;                   /* Size of the partial write */
+    char *ring;                            /* Byte ring holding all writes back to back, NULL when each write has its own buffer */
+    size_t ring_size;                      /* Size of ring, a power of two */
+    struct aesd_mmap_header *mmap_header;  /* Start of the mappable area, the ring follows it */
+    u64 next_entry;                        /* Number of the next write added to the ring */
+    bool merged;                           /* Per CPU mode's minor 0, writes go to the CPU's device */
+    wait_queue_head_t wait;                /* Pollers and tail readers, woken when a write is added */
+    struct aesd_stats __percpu *stats;     /* Kept while aesdchar/stats_enable is set */
+    size_t seal_start;                     /* Running byte count the writes not in a sealed block start at */
+    struct work_struct seal_work;          /* Compresses them once there are compress_block bytes */
+    char *seal_src;                        /* The writes being sealed, 2 * compress_block bytes */
+    char *seal_dst;                        /* Their LZ4 data, as large */
 };
 
+/*
+ * State of one open file, its private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    struct mutex lock;                     /* Serializes writes through this file */
+    struct aesd_write_buf *partial_write;  /* Line being assembled from writes through this file */
+    size_t partial_write_size;
+    size_t anchor;                         /* Running byte count f_pos was last counted from, see aesd_tail_wait() */
+    bool tail;                             /* Reads at the end wait for the next write, AESDCHAR_IOCTAIL */
+};
+
+extern struct aesd_dev *aesd_devices;      /* One per minor */
+extern unsigned int aesd_ndevs;
+extern struct srcu_struct aesd_srcu;       /* Held by readers, evicted writes are freed once they are done */
+
 int aesd_open(struct inode *, struct file *);
 int aesd_release(struct inode *, struct file *);
-ssize_t aesd_read(struct file *, char __user *, size_t, loff_t *);
+ssize_t aesd_read_iter(struct kiocb *, struct iov_iter *);
 ssize_t aesd_write(struct file *, const char __user *, size_t, loff_t *);
 int aesd_init_module(void);
 void aesd_cleanup_module(void);
@@ -12,157 +12,1380 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
-#include <linux/slab.h>  // For kmalloc, krealloc, kfree
+#include <linux/slab.h>  // For kmalloc, kfree and the write buffer caches
+#include <linux/vmalloc.h> // Byte ring storage
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uio.h> // iov_iter, UIO_MAXIOV for the batched ioctls
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
+#include <linux/err.h>
+#include <crypto/acompress.h>
 #include "aesd_ioctl.h"
 #include <linux/uaccess.h>
 #include "aesdchar.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+static uint depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(depth, uint, 0444);
+MODULE_PARM_DESC(depth, "Number of writes kept (default 10), AESDCHAR_IOCRESIZE changes it at runtime");
+
+static ulong ring_bytes = 0;
+module_param(ring_bytes, ulong, 0444);
+MODULE_PARM_DESC(ring_bytes, "Keep writes in one byte ring of this size, rounded up to a power of two, "
+                 "and evict by bytes instead of count (default 0: one buffer per write)");
+
+static uint devices = 1;
+module_param(devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of independent devices on minors 0..devices-1 (default 1), "
+                 "set to the number of minors in use once loaded");
+
+static bool percpu;
+module_param(percpu, bool, 0444);
+MODULE_PARM_DESC(percpu, "One device per CPU on minors 1..N, minor 0 adds writes to the calling CPU's "
+                 "and reads all of them merged in write order (default off)");
+
+static uint compress_block;
+module_param(compress_block, uint, 0444);
+MODULE_PARM_DESC(compress_block, "Store writes LZ4 compressed together once this many bytes of them were added, "
+                 "up to 64 KiB, reads decompress them (default 0: stored as they are). "
+                 "Needs the lz4 crypto algorithm, CONFIG_CRYPTO_LZ4");
+
 MODULE_AUTHOR("Rajkumar Saravanakumar"); 
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
+unsigned int aesd_ndevs;
+struct srcu_struct aesd_srcu; // Shared by every device so the merged view reads them all in one section
+static atomic64_t aesd_seq;   // Next number for a write to any of the per CPU devices
+
+/*
+ * Readers take no lock. Writers still serialize on dev->lock and change the
+ * circular buffer inside a dev->seq write section, so a reader whose lookup
+ * overlapped one sees the count change and looks again. The bytes are copied
+ * to user space outside of that: a write's own buffer never changes once
+ * added, and once evicted it is only freed after every SRCU reader that may
+ * have found it is done, as is slot storage a resize replaced. SRCU rather
+ * than RCU since copying to user memory may sleep.
+ */
+
+/*
+ * A write's own buffer when not in byte ring mode, buffptr points at data.
+ * Also holds a partial write while it grows, or a sealed block.
+ */
+struct aesd_write_buf {
+    struct rcu_head rcu;
+    union {
+        u64 seq;   // Order among the writes to every per CPU device
+        u64 start; // Running byte count a sealed block's first write starts at
+    };
+    u32 cap; // Bytes data has room for
+    u8 class; // Size class it came from, AESD_BUF_CLASSES for kmalloc
+    u8 sealed; // data holds a struct aesd_zblock
+    char data[];
+};
+
+/*
+ * With compress_block set, consecutive writes compressed together once there
+ * are enough of them, see aesd_seal_work(). Every entry of them points at the
+ * data of the buffer holding the block.
+ */
+struct aesd_zblock {
+    u32 size;  // Bytes of the writes
+    u32 zsize; // Bytes of LZ4 data
+    u32 refs;  // Entries still pointing at it, under dev->lock
+    char lz4[];
+} __packed;
+
+static inline struct aesd_write_buf *to_write_buf(const char *buffptr)
+{
+    return (struct aesd_write_buf *)(buffptr - offsetof(struct aesd_write_buf, data));
+}
+
+/*
+ * Write buffers come from one slab cache per power of two size class, from
+ * AESD_BUF_MIN bytes on, so the small writes that come at a high rate neither
+ * share kmalloc caches with the rest of the kernel nor round to odd sizes.
+ * Larger ones come from kmalloc. The counts are in debugfs, aesdchar/alloc.
+ */
+#define AESD_BUF_MIN_SHIFT 6
+#define AESD_BUF_MIN (1U << AESD_BUF_MIN_SHIFT)
+#define AESD_BUF_CLASSES 6 // Up to 2 KiB
+
+static struct kmem_cache *aesd_buf_cache[AESD_BUF_CLASSES];
+static const char * const aesd_buf_cache_name[AESD_BUF_CLASSES] = {
+    "aesdchar-64", "aesdchar-128", "aesdchar-256", "aesdchar-512", "aesdchar-1k", "aesdchar-2k",
+};
+
+static struct {
+    atomic64_t allocs[AESD_BUF_CLASSES + 1];
+    atomic64_t frees[AESD_BUF_CLASSES + 1];
+    atomic64_t partial_grows; // Partial writes moved to a larger buffer
+    atomic64_t live_bytes;    // Allocated now, headers and slack included
+    atomic64_t seal_blocks;   // Sealed blocks made
+    atomic64_t seal_in;       // Bytes of writes they hold
+    atomic64_t seal_out;      // Bytes of LZ4 data they hold
+    atomic64_t seal_skipped;  // Runs of writes left as they were, compressing saved too little
+} aesd_alloc_stats;
+
+static struct dentry *aesd_debugfs;
+
+/*
+ * Per device counters in debugfs, aesdchar/<minor>/stats, kept only while
+ * aesdchar/stats_enable is set, so otherwise they cost a patched out branch
+ * each. Per CPU, so the readers that take no lock do not share a cache line
+ * to count.
+ */
+static DEFINE_STATIC_KEY_FALSE(aesd_stats_key);
+
+#define aesd_stat_add(dev, field, n) \
+    do { \
+        if (static_branch_unlikely(&aesd_stats_key)) \
+            this_cpu_add((dev)->stats->field, (n)); \
+    } while (0)
+
+static inline unsigned int aesd_dev_minor(const struct aesd_dev *dev)
+{
+    return MINOR(dev->cdev.dev);
+}
+
+/*
+ * Take dev->lock, timing the wait and, with aesd_unlock(), the hold while
+ * the counters are on. @return what aesd_unlock() needs
+ */
+static inline u64 aesd_lock(struct aesd_dev *dev)
+{
+    u64 start, locked;
+
+    if (!static_branch_unlikely(&aesd_stats_key)) {
+        mutex_lock(&dev->lock);
+        return 0;
+    }
+    start = ktime_get_ns();
+    mutex_lock(&dev->lock);
+    locked = ktime_get_ns();
+    this_cpu_inc(dev->stats->lock_acquires);
+    this_cpu_add(dev->stats->lock_wait_ns, locked - start);
+    return locked;
+}
+
+static inline void aesd_unlock(struct aesd_dev *dev, u64 locked)
+{
+    if (locked)
+        this_cpu_add(dev->stats->lock_hold_ns, ktime_get_ns() - locked);
+    mutex_unlock(&dev->lock);
+}
+
+static void aesd_evicted(struct aesd_dev *dev, u64 seq, size_t size)
+{
+    trace_aesd_evict(aesd_dev_minor(dev), seq, size);
+    aesd_stat_add(dev, evictions, 1);
+}
+
+/*
+ * A buffer with room for at least len bytes of data
+ */
+static struct aesd_write_buf *aesd_buf_alloc(size_t len)
+{
+    struct aesd_write_buf *wb;
+    size_t size = struct_size(wb, data, len);
+    unsigned int class = size <= AESD_BUF_MIN ? 0 : fls_long(size - 1) - AESD_BUF_MIN_SHIFT;
+
+    if (len > U32_MAX - AESD_BUF_MIN)
+        return NULL;
+    if (class < AESD_BUF_CLASSES) {
+        wb = kmem_cache_alloc(aesd_buf_cache[class], GFP_KERNEL);
+        size = AESD_BUF_MIN << class;
+    } else {
+        class = AESD_BUF_CLASSES;
+        wb = kmalloc(size, GFP_KERNEL);
+    }
+    if (!wb)
+        return NULL;
+
+    wb->cap = size - offsetof(struct aesd_write_buf, data);
+    wb->class = class;
+    wb->sealed = 0;
+    atomic64_inc(&aesd_alloc_stats.allocs[class]);
+    atomic64_add(size, &aesd_alloc_stats.live_bytes);
+    return wb;
+}
+
+static void aesd_buf_free(struct aesd_write_buf *wb)
+{
+    atomic64_inc(&aesd_alloc_stats.frees[wb->class]);
+    atomic64_sub(wb->cap + offsetof(struct aesd_write_buf, data), &aesd_alloc_stats.live_bytes);
+    if (wb->class < AESD_BUF_CLASSES)
+        kmem_cache_free(aesd_buf_cache[wb->class], wb);
+    else
+        kfree(wb);
+}
+
+static void aesd_write_buf_free(struct rcu_head *head)
+{
+    aesd_buf_free(container_of(head, struct aesd_write_buf, rcu));
+}
+
+static void aesd_buf_caches_destroy(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < AESD_BUF_CLASSES; i++) {
+        kmem_cache_destroy(aesd_buf_cache[i]);
+        aesd_buf_cache[i] = NULL;
+    }
+}
+
+static int aesd_buf_caches_create(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < AESD_BUF_CLASSES; i++) {
+        aesd_buf_cache[i] = kmem_cache_create(aesd_buf_cache_name[i], AESD_BUF_MIN << i, 0, 0, NULL);
+        if (!aesd_buf_cache[i]) {
+            aesd_buf_caches_destroy();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static int aesd_alloc_show(struct seq_file *s, void *unused)
+{
+    unsigned int i;
+
+    seq_printf(s, "%-8s %14s %14s\n", "size", "allocs", "frees");
+    for (i = 0; i <= AESD_BUF_CLASSES; i++) {
+        if (i < AESD_BUF_CLASSES)
+            seq_printf(s, "%-8u", AESD_BUF_MIN << i);
+        else
+            seq_printf(s, "%-8s", "kmalloc");
+        seq_printf(s, " %14lld %14lld\n", (long long)atomic64_read(&aesd_alloc_stats.allocs[i]),
+                   (long long)atomic64_read(&aesd_alloc_stats.frees[i]));
+    }
+    seq_printf(s, "partial_grows %lld\n", (long long)atomic64_read(&aesd_alloc_stats.partial_grows));
+    seq_printf(s, "live_bytes %lld\n", (long long)atomic64_read(&aesd_alloc_stats.live_bytes));
+    seq_printf(s, "sealed_blocks %lld in %lld out %lld skipped %lld\n",
+               (long long)atomic64_read(&aesd_alloc_stats.seal_blocks),
+               (long long)atomic64_read(&aesd_alloc_stats.seal_in),
+               (long long)atomic64_read(&aesd_alloc_stats.seal_out),
+               (long long)atomic64_read(&aesd_alloc_stats.seal_skipped));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_alloc);
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats sum = { 0 };
+    unsigned int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        const struct aesd_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+        sum.read_ops += st->read_ops;
+        sum.read_bytes += st->read_bytes;
+        sum.write_ops += st->write_ops;
+        sum.write_bytes += st->write_bytes;
+        sum.evictions += st->evictions;
+        sum.lock_acquires += st->lock_acquires;
+        sum.lock_wait_ns += st->lock_wait_ns;
+        sum.lock_hold_ns += st->lock_hold_ns;
+        for (i = 0; i < AESD_PARTIAL_HIST; i++)
+            sum.partial_hist[i] += st->partial_hist[i];
+    }
+    seq_printf(s, "read_ops %llu\nread_bytes %llu\n", sum.read_ops, sum.read_bytes);
+    seq_printf(s, "write_ops %llu\nwrite_bytes %llu\n", sum.write_ops, sum.write_bytes);
+    seq_printf(s, "evictions %llu\n", sum.evictions);
+    seq_printf(s, "lock_acquires %llu\nlock_wait_ns %llu\nlock_hold_ns %llu\n",
+               sum.lock_acquires, sum.lock_wait_ns, sum.lock_hold_ns);
+    seq_puts(s, "partial_bytes lines\n");
+    for (i = 0; i < AESD_PARTIAL_HIST; i++)
+        seq_printf(s, "%s%-13lu %llu\n", i == AESD_PARTIAL_HIST - 1 ? ">=" : "<",
+                   i == AESD_PARTIAL_HIST - 1 ? 1UL << (i - 1) : 1UL << i, sum.partial_hist[i]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_stats_enable_get(void *data, u64 *val)
+{
+    *val = static_key_enabled(&aesd_stats_key);
+    return 0;
+}
+
+static int aesd_stats_enable_set(void *data, u64 val)
+{
+    if (val)
+        static_branch_enable(&aesd_stats_key);
+    else
+        static_branch_disable(&aesd_stats_key);
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(aesd_stats_enable_fops, aesd_stats_enable_get, aesd_stats_enable_set, "%llu\n");
+
+static void aesd_debugfs_create(void)
+{
+    char name[16];
+    unsigned int i;
+
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("alloc", 0444, aesd_debugfs, NULL, &aesd_alloc_fops);
+    debugfs_create_file_unsafe("stats_enable", 0644, aesd_debugfs, NULL, &aesd_stats_enable_fops);
+    for (i = 0; i < aesd_ndevs; i++) {
+        snprintf(name, sizeof(name), "%u", aesd_minor + i);
+        debugfs_create_file("stats", 0444, debugfs_create_dir(name, aesd_debugfs),
+                            &aesd_devices[i], &aesd_stats_fops);
+    }
+}
+
+/*
+ * Drop an entry's hold on its buffer, only a sealed block has more than one.
+ * Called with dev->lock held. @return true if that was the last
+ */
+static bool aesd_buf_put(struct aesd_write_buf *wb)
+{
+    return !wb->sealed || --((struct aesd_zblock *)wb->data)->refs == 0;
+}
+
+/*
+ * Free the buffer of a write dropped from the circular buffer once no reader
+ * can be copying from it anymore.
+ */
+static void aesd_retire(struct aesd_dev *dev, const struct aesd_buffer_entry *dropped)
+{
+    if (!dev->ring && dropped->buffptr && aesd_buf_put(to_write_buf(dropped->buffptr)))
+        call_srcu(&aesd_srcu, &to_write_buf(dropped->buffptr)->rcu, aesd_write_buf_free);
+}
+
+/*
+ * Find what is stored at *pos without dev->lock: *ptr is set to the start of
+ * the write holding it, *offset to where the byte is in the write and *size
+ * to the write's size. A sealed write's *ptr is its block, aesd_copy_entry()
+ * reads both.
+ * *pos is a running byte count (see entry_start in struct
+ * aesd_circular_buffer), or a file position if is_fpos is set, which is then
+ * turned into a running byte count. Positions in the file move whenever the
+ * oldest write is evicted and running byte counts do not, so a read that
+ * continues by them stays consistent while writers go on.
+ * The caller holds aesd_srcu for as long as it uses *ptr.
+ * @return false if nothing is stored at *pos
+ */
+static bool aesd_entry_at(struct aesd_dev *dev, size_t *pos, bool is_fpos, const char **ptr, size_t *offset,
+                          size_t *size)
+{
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    struct aesd_buffer_entry *entry;
+    const char *buffptr = NULL;
+    size_t base, entry_offset = 0, entry_size = 0;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        base = cb->base_offs;
+        // Evicted running positions wrap around to far past the end
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(cb, is_fpos ? *pos : *pos - base,
+                                                                &entry_offset);
+        if (entry) {
+            buffptr = READ_ONCE(entry->buffptr);
+            entry_size = READ_ONCE(entry->size);
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (!entry)
+        return false;
+    if (is_fpos)
+        *pos += base;
+    *ptr = buffptr;
+    *offset = entry_offset;
+    *size = entry_size;
+    return true;
+}
+
+/*
+ * Largest compress_block, a block holds less than twice that
+ */
+#define AESD_SEAL_MAX_BLOCK (64 * 1024)
+
+// The lz4 transform, only looked up with compress_block set so the module does not need it otherwise
+static struct crypto_acomp *aesd_lz4;
+
+/*
+ * Compress or decompress slen bytes at src into dst, which has room for dlen.
+ * Both must be kmalloc memory. @return the bytes stored in dst or an error
+ */
+static int aesd_lz4_run(bool compress, const void *src, unsigned int slen, void *dst, unsigned int dlen)
+{
+    struct acomp_req *req = acomp_request_alloc(aesd_lz4);
+    struct scatterlist sg_src, sg_dst;
+    DECLARE_CRYPTO_WAIT(wait);
+    int retval;
+
+    if (!req)
+        return -ENOMEM;
+    sg_init_one(&sg_src, src, slen);
+    sg_init_one(&sg_dst, dst, dlen);
+    acomp_request_set_params(req, &sg_src, &sg_dst, slen, dlen);
+    acomp_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG, crypto_req_done, &wait);
+    retval = crypto_wait_req(compress ? crypto_acomp_compress(req) : crypto_acomp_decompress(req), &wait);
+    if (!retval)
+        retval = req->dlen;
+    acomp_request_free(req);
+    return retval;
+}
+
+/*
+ * Where a read decompresses sealed blocks, holding the last one it met
+ */
+struct aesd_unz {
+    const struct aesd_write_buf *block;
+    char *buf;
+    size_t cap;
+};
+
+/*
+ * Copy n bytes from offset on of the write at buffptr to to. pos is
+ * the running byte count of the first of them, which finds them in a sealed
+ * block. A block is decompressed whole into unz, so a read going through its
+ * writes does that once. Called with aesd_srcu held.
+ * @return 0, or -EFAULT, -ENOMEM or -EIO
+ */
+static int aesd_copy_entry(struct iov_iter *to, const char *buffptr, size_t offset, size_t pos, size_t n,
+                           struct aesd_unz *unz)
+{
+    const struct aesd_write_buf *wb = to_write_buf(buffptr);
+    const struct aesd_zblock *zb = (const struct aesd_zblock *)wb->data;
+
+    if (!compress_block || !wb->sealed)
+        return copy_to_iter(buffptr + offset, n, to) != n ? -EFAULT : 0;
+
+    if (unz->block != wb) {
+        if (unz->cap < zb->size) {
+            kfree(unz->buf);
+            unz->buf = kmalloc(zb->size, GFP_KERNEL);
+            unz->cap = unz->buf ? zb->size : 0;
+            unz->block = NULL;
+            if (!unz->buf)
+                return -ENOMEM;
+        }
+        if (aesd_lz4_run(false, zb->lz4, zb->zsize, unz->buf, zb->size) != zb->size)
+            return -EIO;
+        unz->block = wb;
+    }
+    return copy_to_iter(unz->buf + (pos - (size_t)wb->start), n, to) != n ? -EFAULT : 0;
+}
+
+
+/*
+ * Slot storage a resize replaced, kept until no lookup can be using it
+ */
+struct aesd_old_slots {
+    struct rcu_head rcu;
+    struct aesd_circular_buffer_slots slots;
+};
+
+static void aesd_old_slots_free(struct rcu_head *head)
+{
+    struct aesd_old_slots *old = container_of(head, struct aesd_old_slots, rcu);
+
+    aesd_circular_buffer_free_slots(&old->slots);
+    kfree(old);
+}
+
+/*
+ * Switch the circular buffer to a new depth. Lookups may still be running on
+ * the slot storage it replaces, which is freed when they are done, without
+ * waiting for them here: writers would all stall behind the lock meanwhile.
+ * Called with dev->lock held.
+ */
+static int aesd_resize(struct aesd_dev *dev, u32 new_depth)
+{
+    struct aesd_circular_buffer_slots slots;
+    struct aesd_old_slots *old = kmalloc(sizeof(*old), GFP_KERNEL);
+    int retval;
+
+    if (!old)
+        return -ENOMEM;
+    retval = aesd_circular_buffer_prepare_resize(&dev->circular_buffer, new_depth, &slots);
+    if (retval) {
+        kfree(old);
+        return retval;
+    }
+
+    write_seqcount_begin(&dev->seq);
+    aesd_circular_buffer_commit_resize(&dev->circular_buffer, new_depth, &slots);
+    write_seqcount_end(&dev->seq);
+
+    if (slots.entry) {
+        old->slots = slots;
+        call_srcu(&aesd_srcu, &old->rcu, aesd_old_slots_free);
+    } else {
+        kfree(old);
+    }
+    return 0;
+}
+
+/*
+ * Running byte counts of the oldest byte stored and of the end of the newest
+ * write, which moves on with every write even when evictions keep the size
+ * the same
+ */
+static void aesd_bounds(struct aesd_dev *dev, size_t *base, size_t *end)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        *base = dev->circular_buffer.base_offs;
+        *end = *base + aesd_circular_buffer_size(&dev->circular_buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+}
+
+static size_t aesd_end(struct aesd_dev *dev)
+{
+    size_t base, end;
+
+    aesd_bounds(dev, &base, &end);
+    return end;
+}
+
+/*
+ * Wake pollers and tail readers after a write was added, on the merged view
+ * too in per CPU mode
+ */
+static void aesd_wake(struct aesd_dev *dev)
+{
+    if (wq_has_sleeper(&dev->wait))
+        wake_up_interruptible(&dev->wait);
+    if (percpu && wq_has_sleeper(&aesd_devices[0].wait))
+        wake_up_interruptible(&aesd_devices[0].wait);
+}
+
+/*
+ * Byte ring storage: every complete write is copied to the end of one large
+ * ring and the circular buffer only indexes it. The circular buffer's running
+ * byte counts double as ring positions, so the oldest write starts at
+ * base_offs and the next one goes at base_offs + total_size (both masked),
+ * and the stored writes are always contiguous in the ring apart from the
+ * wrap. An entry's buffptr is where it starts in the ring, its bytes may
+ * continue at the start of the ring.
+ *
+ * The ring sits right after a header that mirrors the positions and the most
+ * recent writes, and both can be mapped read only by user space.
+ */
+
+/*
+ * Mirror the ring positions in the mapped header, and the write just added
+ * if added is set. Called with dev->lock held after every change.
+ */
+static void aesd_mmap_publish(struct aesd_dev *dev, const struct aesd_buffer_entry *added)
+{
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    struct aesd_mmap_header *hdr = dev->mmap_header;
+    u64 count = min_t(u64, aesd_circular_buffer_count(cb), AESD_MMAP_INDEX_SLOTS);
+
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb(); // Readers see seq odd before any field changes
+    if (added) {
+        struct aesd_mmap_entry *e = &hdr->index[dev->next_entry % AESD_MMAP_INDEX_SLOTS];
+
+        e->start = cb->base_offs + cb->total_size - added->size;
+        e->size = added->size;
+        dev->next_entry++;
+    }
+    hdr->tail = cb->base_offs;
+    hdr->head = cb->base_offs + cb->total_size;
+    hdr->first_entry = dev->next_entry - count;
+    hdr->next_entry = dev->next_entry;
+    smp_wmb(); // The ring data and fields are visible before seq turns even
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/*
+ * Copy up to count bytes from *pos to to, across as many writes as fit, and
+ * move *pos past them. *pos is a file position or a running byte count as for
+ * aesd_entry_at(), and a running byte count on return. Takes no lock: writers
+ * evict before they write over ring space, so the copy is good unless the
+ * oldest write moved past its start meanwhile, and is made again if it did.
+ */
+static ssize_t aesd_ring_read(struct aesd_dev *dev, struct iov_iter *to, size_t count, size_t *pos, bool is_fpos)
+{
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    size_t base, total, offset, start, first, n;
+    unsigned int seq;
+
+    for (;;) {
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            base = cb->base_offs;
+            total = aesd_circular_buffer_size(cb);
+        } while (read_seqcount_retry(&dev->seq, seq));
+
+        offset = is_fpos ? *pos : *pos - base; // Evicted running positions wrap around to far past the end
+        if (offset >= total)
+            return 0;
+        n = min(count, total - offset);
+
+        start = (base + offset) & (dev->ring_size - 1);
+        first = min(n, dev->ring_size - start);
+        if (copy_to_iter(dev->ring + start, first, to) != first ||
+            copy_to_iter(dev->ring, n - first, to) != n - first)
+            return -EFAULT;
+
+        smp_rmb(); // Pairs with the write section that evicts before the ring is written over
+        if (READ_ONCE(cb->base_offs) - base <= offset)
+            break;
+        iov_iter_revert(to, n);
+    }
+
+    *pos = base + offset + n;
+    return n;
+}
+
+/*
+ * Append one complete write of len bytes, copied from user memory if ubuf is
+ * set or from kbuf otherwise, evicting the oldest writes to make room. The
+ * index grows rather than evict while the ring still has space.
+ * Called with dev->lock held.
+ */
+static int aesd_ring_add(struct aesd_dev *dev, const char __user *ubuf, const char *kbuf, size_t len)
+{
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    struct aesd_buffer_entry entry, dropped;
+    size_t start, first;
+
+    if (len > dev->ring_size)
+        return -ENOSPC;
+
+    if (aesd_circular_buffer_size(cb) + len > dev->ring_size) {
+        write_seqcount_begin(&dev->seq);
+        while (aesd_circular_buffer_size(cb) + len > dev->ring_size &&
+               aesd_circular_buffer_drop_oldest(cb, &dropped)) {
+            aesd_evicted(dev, cb->out_seq - 1, dropped.size);
+        }
+        write_seqcount_end(&dev->seq);
+        // Readers must see the space go before it is written over
+        aesd_mmap_publish(dev, NULL);
+    }
+    if (cb->full && cb->depth < AESDCHAR_MAX_DEPTH)
+        aesd_resize(dev, min_t(u32, cb->depth * 2, AESDCHAR_MAX_DEPTH)); // On failure the oldest write goes by count
+
+    start = (cb->base_offs + cb->total_size) & (dev->ring_size - 1);
+    first = min(len, dev->ring_size - start);
+    if (ubuf) {
+        if (copy_from_user(dev->ring + start, ubuf, first) ||
+            copy_from_user(dev->ring, ubuf + first, len - first))
+            return -EFAULT;
+    } else {
+        memcpy(dev->ring + start, kbuf, first);
+        memcpy(dev->ring, kbuf + first, len - first);
+    }
+
+    entry.buffptr = dev->ring + start;
+    entry.size = len;
+    write_seqcount_begin(&dev->seq);
+    if (cb->full)
+        aesd_evicted(dev, cb->out_seq, cb->entry[cb->out_offs].size);
+    aesd_circular_buffer_add_entry(cb, &entry);
+    write_seqcount_end(&dev->seq);
+    aesd_mmap_publish(dev, &entry);
+    aesd_wake(dev);
+    return 0;
+}
+
+/*
+ * Work item sealing the writes added since the last block, see aesd_zblock.
+ * Once they add up to compress_block bytes the oldest of them are copied out
+ * through the lockless lookups, compressed together unless that saves less
+ * than an eighth, and their entries pointed at the block. Lines of the same
+ * kind compress well together even when each is too short to on its own.
+ * dev->lock is only taken to swap the entries, so writers do not wait for
+ * the copying and compression. Only this work item moves seal_start.
+ */
+static void aesd_seal_work(struct work_struct *work)
+{
+    struct aesd_dev *dev = container_of(work, struct aesd_dev, seal_work);
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    struct aesd_buffer_entry *entry;
+    struct aesd_write_buf *wb;
+    struct aesd_zblock *zb;
+    size_t base, end, start, pos, len = 0, offset, size;
+    const char *ptr;
+    u32 index, n = 0, i;
+    int zsize, idx;
+    u64 locked;
+
+    aesd_bounds(dev, &base, &end);
+    start = dev->seal_start;
+    if ((ssize_t)(start - base) < 0)
+        start = base; // The oldest of them were evicted already
+    if (end - start < compress_block)
+        return;
+
+    // Writes are only freed once no SRCU reader is left, so copying needs no lock
+    idx = srcu_read_lock(&aesd_srcu);
+    for (pos = start; len < compress_block; pos += size) {
+        if (!aesd_entry_at(dev, &pos, false, &ptr, &offset, &size))
+            break; // Evicted meanwhile
+        if (len + size > 2 * compress_block) {
+            // Too large to seal with the others, it and the short run before it stay as they are
+            start = pos + size;
+            len = 0;
+            n = 0;
+            continue;
+        }
+        memcpy(dev->seal_src + len, ptr, size);
+        len += size;
+        n++;
+    }
+    srcu_read_unlock(&aesd_srcu, idx);
+    if (len < compress_block) {
+        WRITE_ONCE(dev->seal_start, start);
+        return;
+    }
+    WRITE_ONCE(dev->seal_start, pos);
+
+    zsize = aesd_lz4_run(true, dev->seal_src, len, dev->seal_dst, len - len / 8);
+    wb = zsize > 0 ? aesd_buf_alloc(sizeof(*zb) + zsize) : NULL;
+    if (!wb) {
+        atomic64_inc(&aesd_alloc_stats.seal_skipped);
+        goto again;
+    }
+    wb->sealed = 1;
+    wb->start = start;
+    zb = (struct aesd_zblock *)wb->data;
+    zb->size = len;
+    zb->zsize = zsize;
+    zb->refs = n;
+    memcpy(zb->lz4, dev->seal_dst, zsize);
+
+    // Evictions go oldest first, so if the first write is still there all of them are
+    locked = aesd_lock(dev);
+    if ((ssize_t)(start - cb->base_offs) < 0) {
+        aesd_unlock(dev, locked);
+        aesd_buf_free(wb);
+        atomic64_inc(&aesd_alloc_stats.seal_skipped);
+        goto again;
+    }
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(cb, start - cb->base_offs, &offset);
+    index = entry - cb->entry;
+    write_seqcount_begin(&dev->seq);
+    for (i = 0; i < n; i++) {
+        entry = &cb->entry[(index + i) & cb->size_mask];
+        call_srcu(&aesd_srcu, &to_write_buf(entry->buffptr)->rcu, aesd_write_buf_free);
+        WRITE_ONCE(entry->buffptr, wb->data);
+    }
+    write_seqcount_end(&dev->seq);
+    aesd_unlock(dev, locked);
+
+    atomic64_inc(&aesd_alloc_stats.seal_blocks);
+    atomic64_add(len, &aesd_alloc_stats.seal_in);
+    atomic64_add(zsize, &aesd_alloc_stats.seal_out);
+again:
+    // More may have been added meanwhile
+    if (aesd_end(dev) - dev->seal_start >= compress_block)
+        queue_work(system_unbound_wq, &dev->seal_work);
+}
+
+/*
+ * Store one complete write of len bytes that wb holds, evicting the oldest
+ * write if the circular buffer is full. wb belongs to the circular buffer
+ * from then on. Called with dev->lock held.
+ */
+static void aesd_entry_commit(struct aesd_dev *dev, struct aesd_write_buf *wb, size_t len)
+{
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    struct aesd_buffer_entry entry, evicted = { 0 };
+    u64 evicted_seq = 0;
+
+    if (percpu)
+        wb->seq = atomic64_inc_return(&aesd_seq) - 1;
+    entry.buffptr = wb->data;
+    entry.size = len;
+    write_seqcount_begin(&dev->seq);
+    if (cb->full) {
+        evicted = cb->entry[cb->out_offs];
+        evicted_seq = cb->out_seq;
+    }
+    aesd_circular_buffer_add_entry(cb, &entry);
+    write_seqcount_end(&dev->seq);
+
+    if (evicted.buffptr)
+        aesd_evicted(dev, evicted_seq, evicted.size);
+    aesd_retire(dev, &evicted);
+    if (compress_block && cb->base_offs + cb->total_size - READ_ONCE(dev->seal_start) >= compress_block)
+        queue_work(system_unbound_wq, &dev->seal_work);
+    aesd_wake(dev);
+}
+
+/*
+ * Copy one complete write of len bytes from user memory into its own buffer
+ * *wbp, before taking dev->lock to commit it, so neither the allocation nor a
+ * page fault happens under the lock
+ */
+static int aesd_entry_copy(const char __user *ubuf, size_t len, struct aesd_write_buf **wbp)
+{
+    struct aesd_write_buf *wb = aesd_buf_alloc(len);
+
+    if (!wb)
+        return -ENOMEM;
+    if (copy_from_user(wb->data, ubuf, len)) {
+        aesd_buf_free(wb);
+        return -EFAULT;
+    }
+
+    *wbp = wb;
+    return 0;
+}
+
+/*
+ * Append count bytes, copied from user memory if ubuf is set or from kbuf
+ * otherwise, to the partial write *wbp of *size bytes. Its buffer at least
+ * doubles when it has to grow, so a write split into many pieces is not
+ * copied over again for every piece. Called with the lock of whatever holds
+ * the partial write.
+ */
+static int aesd_partial_append(struct aesd_write_buf **wbp, size_t *sizep, const char __user *ubuf,
+                               const char *kbuf, size_t count)
+{
+    struct aesd_write_buf *wb = *wbp, *grown;
+    size_t size = *sizep;
+
+    if (count > SIZE_MAX / 2 - size)
+        return -ENOMEM;
+    if (!wb || size + count > wb->cap) {
+        grown = aesd_buf_alloc(max(size + count, wb ? 2 * (size_t)wb->cap : 0));
+        if (!grown)
+            return -ENOMEM;
+        if (wb) {
+            memcpy(grown->data, wb->data, size);
+            aesd_buf_free(wb);
+            atomic64_inc(&aesd_alloc_stats.partial_grows);
+        }
+        *wbp = wb = grown;
+    }
+
+    if (!ubuf)
+        memcpy(wb->data + size, kbuf, count);
+    else if (copy_from_user(wb->data + size, ubuf, count))
+        return -EFAULT;
+    *sizep += count;
+    return 0;
+}
+
+/*
+ * Take over the unfinished line a file left when it was closed, see aesd_release().
+ * Called with file->lock held.
+ */
+static void aesd_partial_adopt(struct aesd_file *file)
+{
+    struct aesd_dev *dev = file->dev;
+
+    mutex_lock(&dev->lock);
+    file->partial_write = dev->partial_write;
+    file->partial_write_size = dev->partial_write_size;
+    dev->partial_write = NULL;
+    dev->partial_write_size = 0;
+    mutex_unlock(&dev->lock);
+}
+
+/*
+ * Add the line the file assembled, now complete, and start a new one.
+ * Called with file->lock and dev->lock held.
+ */
+static int aesd_partial_commit(struct aesd_file *file, struct aesd_dev *dev)
+{
+    struct aesd_write_buf *wb = file->partial_write;
+    int retval = 0;
+
+    aesd_stat_add(dev, partial_hist[min_t(unsigned int, fls_long(file->partial_write_size),
+                                          AESD_PARTIAL_HIST - 1)], 1);
+    if (dev->ring) {
+        retval = aesd_ring_add(dev, NULL, wb->data, file->partial_write_size);
+        aesd_buf_free(wb);
+    } else {
+        aesd_entry_commit(dev, wb, file->partial_write_size); // Kept as it is, no copy
+    }
+    file->partial_write = NULL;
+    file->partial_write_size = 0;
+    return retval;
+}
+
+/*
+ * Map the header and the ring after it read only, at the offset asked for.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    if (!dev->ring)
+        return -ENODEV; // Writes are not in one place to map
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    // Keep mprotect() from making it writable later
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mmap_header, vma->vm_pgoff);
+}
+
+/*
+ * Per CPU mode: minor 0 has no writes of its own. It adds writes to the
+ * device of the CPU the writer runs on, so writers on different CPUs do not
+ * share a lock, and reads every CPU's writes merged in the order they were
+ * added. Reads of the merged view snapshot each CPU's index under its lock
+ * and merge them by sequence number; aesd_srcu keeps the writes alive.
+ */
+static inline struct aesd_dev *aesd_cpu_dev(unsigned int cpu)
+{
+    return &aesd_devices[1 + cpu];
+}
+
+struct aesd_merge_src {
+    struct aesd_buffer_entry *entry; // Oldest first
+    u32 count;
+    u32 next;
+};
+
+struct aesd_merge {
+    unsigned int nsrc;
+    struct aesd_merge_src src[];
+};
+
+static void aesd_merge_end(struct aesd_merge *m)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->nsrc; i++)
+        kvfree(m->src[i].entry);
+    kfree(m);
+}
+
+/*
+ * Snapshot every CPU's writes. The caller holds aesd_srcu until
+ * aesd_merge_end().
+ */
+static struct aesd_merge *aesd_merge_start(void)
+{
+    struct aesd_merge *m = kzalloc(struct_size(m, src, nr_cpu_ids), GFP_KERNEL);
+    struct aesd_buffer_entry *entry;
+    unsigned int cpu;
+    u32 index;
+
+    if (!m)
+        return NULL;
+    for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+        struct aesd_dev *dev = aesd_cpu_dev(cpu);
+        struct aesd_merge_src *src = &m->src[m->nsrc++];
+
+        mutex_lock(&dev->lock);
+        src->entry = kvmalloc_array(max_t(size_t, aesd_circular_buffer_count(&dev->circular_buffer), 1),
+                                    sizeof(*src->entry), GFP_KERNEL);
+        if (!src->entry) {
+            mutex_unlock(&dev->lock);
+            aesd_merge_end(m);
+            return NULL;
+        }
+        // Slots in use follow out_offs, the rest are empty
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buffer, index) {
+            if (entry->buffptr)
+                src->entry[src->count++] = *entry;
+        }
+        mutex_unlock(&dev->lock);
+    }
+    return m;
+}
+
+/*
+ * @return the oldest write not yet returned, or NULL after the newest
+ */
+static const struct aesd_buffer_entry *aesd_merge_next(struct aesd_merge *m)
+{
+    struct aesd_merge_src *oldest = NULL;
+    unsigned int i;
+
+    for (i = 0; i < m->nsrc; i++) {
+        struct aesd_merge_src *src = &m->src[i];
+
+        if (src->next < src->count &&
+            (!oldest || to_write_buf(src->entry[src->next].buffptr)->seq <
+                        to_write_buf(oldest->entry[oldest->next].buffptr)->seq))
+            oldest = src;
+    }
+    return oldest ? &oldest->entry[oldest->next++] : NULL;
+}
+
+static loff_t aesd_merged_size(void)
+{
+    loff_t size = 0;
+    unsigned int cpu;
+
+    for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+        size += READ_ONCE(aesd_cpu_dev(cpu)->circular_buffer.total_size);
+    return size;
+}
+
+static ssize_t aesd_merged_read(struct iov_iter *to, size_t count, loff_t *f_pos)
+{
+    const struct aesd_buffer_entry *entry;
+    struct aesd_merge *m;
+    loff_t skip = *f_pos;
+    ssize_t retval = 0;
+    int idx;
+
+    idx = srcu_read_lock(&aesd_srcu);
+    m = aesd_merge_start();
+    if (!m) {
+        srcu_read_unlock(&aesd_srcu, idx);
+        return -ENOMEM;
+    }
+
+    while (count > 0 && (entry = aesd_merge_next(m))) {
+        size_t read_size;
+
+        if (skip >= entry->size) {
+            skip -= entry->size;
+            continue;
+        }
+        read_size = min(count, entry->size - (size_t)skip);
+        if (copy_to_iter(entry->buffptr + skip, read_size, to) != read_size) {
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+        skip = 0;
+        *f_pos += read_size;
+        retval += read_size;
+        count -= read_size;
+    }
+
+    aesd_merge_end(m);
+    srcu_read_unlock(&aesd_srcu, idx);
+    return retval;
+}
+
+/*
+ * Position of byte entry_offset of the entry_index'th oldest write in the merged view
+ */
+static int aesd_merged_fpos_for_entry(u32 entry_index, size_t entry_offset, size_t *fpos_rtn)
+{
+    const struct aesd_buffer_entry *entry;
+    struct aesd_merge *m;
+    size_t pos = 0;
+    int retval = -EINVAL, idx;
+
+    idx = srcu_read_lock(&aesd_srcu);
+    m = aesd_merge_start();
+    if (!m) {
+        srcu_read_unlock(&aesd_srcu, idx);
+        return -ENOMEM;
+    }
+    while ((entry = aesd_merge_next(m))) {
+        if (entry_index-- == 0) {
+            if (entry_offset < entry->size) {
+                *fpos_rtn = pos + entry_offset;
+                retval = 0;
+            }
+            break;
+        }
+        pos += entry->size;
+    }
+    aesd_merge_end(m);
+    srcu_read_unlock(&aesd_srcu, idx);
+    return retval;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
     
-    filp->private_data = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    mutex_init(&file->lock);
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    file->anchor = READ_ONCE(file->dev->circular_buffer.base_offs);
+    filp->private_data = file;
      
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
     PDEBUG("release");
     
-    return 0;
+    // Leave an unfinished line to the next write through any file, like echo -n then echo
+    if (file->partial_write) {
+        mutex_lock(&dev->lock);
+        if (!dev->partial_write) {
+            dev->partial_write = file->partial_write;
+            dev->partial_write_size = file->partial_write_size;
+            file->partial_write = NULL;
+        } else if (aesd_partial_append(&dev->partial_write, &dev->partial_write_size, NULL,
+                                       file->partial_write->data, file->partial_write_size)) {
+            PDEBUG("dropped %zu bytes of an unfinished line", file->partial_write_size);
+        }
+        mutex_unlock(&dev->lock);
+        if (file->partial_write)
+            aesd_buf_free(file->partial_write);
+    }
+
+    mutex_destroy(&file->lock);
+    kfree(file);
+    return 0;
+}
+
+/*
+ * Tail mode: a file's position is where its previous read stopped even when
+ * evictions have shifted the file positions since, which the running byte
+ * count file->anchor + f_pos keeps track of. Wait there for a write if there
+ * is nothing to read yet, and start from the oldest byte if what was there
+ * has been evicted meanwhile. Sets *pos to the running byte count to read
+ * from and *f_pos to match.
+ */
+static int aesd_tail_wait(struct aesd_file *file, unsigned int f_flags, loff_t *f_pos, size_t *pos)
+{
+    struct aesd_dev *dev = file->dev;
+    size_t base, end;
+
+    *pos = file->anchor + *f_pos;
+    for (;;) {
+        aesd_bounds(dev, &base, &end);
+        if ((ssize_t)(*pos - base) < 0)
+            *pos = base;
+        if (*pos != end)
+            break;
+        if (f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->wait, aesd_end(dev) != end))
+            return -ERESTARTSYS;
+    }
+
+    file->anchor = base;
+    *f_pos = *pos - base;
+    return 0;
+}
+
+/*
+ * Copy up to count bytes from *pos on, see aesd_entry_at() for what is_fpos means
+ */
+static ssize_t aesd_read_at(struct aesd_dev *dev, struct iov_iter *to, size_t count, loff_t *f_pos,
+                            size_t *pos, bool is_fpos)
+{
+    struct aesd_unz unz = { 0 };
+    ssize_t retval = 0;
+    const char *ptr;
+    size_t offset, size, read_size;
+    int idx, err;
+
+    idx = srcu_read_lock(&aesd_srcu);
+
+    if (dev->ring) {
+        retval = aesd_ring_read(dev, to, count, pos, is_fpos);
+        if (retval > 0)
+            *f_pos += retval;
+        srcu_read_unlock(&aesd_srcu, idx);
+        return retval;
+    }
+    
+    // Fill the buffer from as many consecutive writes as it takes
+    while (count > 0 && aesd_entry_at(dev, pos, is_fpos && retval == 0, &ptr, &offset, &size)) {
+        read_size = min(count, size - offset);
+
+        err = aesd_copy_entry(to, ptr, offset, *pos, read_size, &unz);
+        if (err) {
+            if (retval == 0)
+                retval = err; // Report what was copied before the fault, if anything
+            break;
+        }
+
+        *f_pos += read_size;
+        *pos += read_size;
+        retval += read_size;
+        count -= read_size;
+    }
+
+    srcu_read_unlock(&aesd_srcu, idx);
+    kfree(unz.buf);
+    return retval;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * read() and, through copy_splice_read(), splice() from the device
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
     
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_buffer_entry * entry;
-    size_t entry_offset;
-    
-    if(!dev || !buf) return -EINVAL;
-    
-    mutex_lock(&dev->lock);
-    
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circular_buffer, *f_pos, &entry_offset);
-    if(!entry) {
-    	mutex_unlock(&dev->lock);
-    	return 0;
-    }
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    unsigned int f_flags = filp->f_flags | (iocb->ki_flags & IOCB_NOWAIT ? O_NONBLOCK : 0);
+    loff_t start = *f_pos;
+    size_t pos;
     
-    size_t available = entry->size - entry_offset;
-    size_t read_size = min(count, available);
-    if (copy_to_user(buf, entry->buffptr + entry_offset, read_size)) {
-        mutex_unlock(&dev->lock);
-        return -EFAULT;
+    if (count == 0) return 0;
+    if (dev->merged) {
+        retval = aesd_merged_read(to, count, f_pos);
+        goto out;
     }
-    
-    *f_pos += read_size;
-    retval = read_size;
 
-    mutex_unlock(&dev->lock);
-        
+    // In tail mode the wait can end with what it found evicted already, then wait again
+    do {
+        if (file->tail) {
+            retval = aesd_tail_wait(file, f_flags, f_pos, &pos);
+            if (retval)
+                goto out;
+        } else {
+            pos = *f_pos;
+        }
+        retval = aesd_read_at(dev, to, count, f_pos, &pos, !file->tail);
+    } while (file->tail && retval == 0);
+
+    if (retval > 0)
+        file->anchor = pos - *f_pos;
+
+out:
+    trace_aesd_read(aesd_dev_minor(dev), start, count, retval);
+    aesd_stat_add(dev, read_ops, 1);
+    if (retval > 0)
+        aesd_stat_add(dev, read_bytes, retval);
     return retval;
 }
 
+/*
+ * Readable when a read would return data right away, which for a tail mode
+ * file means anything written after where it stopped
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM; // Writes never wait
+    size_t base, end;
+
+    poll_wait(filp, &dev->wait, wait);
+
+    if (dev->merged) {
+        if (filp->f_pos < aesd_merged_size())
+            mask |= EPOLLIN | EPOLLRDNORM;
+        return mask;
+    }
+
+    aesd_bounds(dev, &base, &end);
+    if (file->tail ? file->anchor + filp->f_pos != end : filp->f_pos < end - base)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = -ENOMEM;
+    ssize_t retval;
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
     
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_buffer_entry new_entry;
-    char *temp_buf;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    char last;
+    u64 locked;
 
-    if (!dev || !buf)
+    if (!buf)
         return -EINVAL;
-
-    temp_buf = kmalloc(count, GFP_KERNEL);
-    if (!temp_buf)
-        return -ENOMEM;
-
-    if (copy_from_user(temp_buf, buf, count)) {
-        kfree(temp_buf);
+    if (count == 0)
+        return 0;
+    if (get_user(last, buf + count - 1))
         return -EFAULT;
-    }
-    
-    mutex_lock(&dev->lock); 
-    
-    if (dev->partial_write) {
-        size_t new_size = dev->partial_write_size + count;
-        char *new_buf = krealloc(dev->partial_write, new_size, GFP_KERNEL);
-        if (!new_buf) {
-            mutex_unlock(&dev->lock);
-            kfree(temp_buf);
-            return -ENOMEM;
-        }
-        memcpy(new_buf + dev->partial_write_size, temp_buf, count);
-        kfree(temp_buf);
-        dev->partial_write = new_buf;
-        dev->partial_write_size = new_size;
+    if (dev->merged)
+        dev = aesd_cpu_dev(raw_smp_processor_id()); // Moving CPU meanwhile only costs some sharing
 
-        if (new_buf[new_size - 1] != '\n') {
-            mutex_unlock(&dev->lock);
-            return count; // write on circular buffer only when terminated with \n
-        }
+    // Each file assembles its own lines, only adding a complete one takes the device lock
+    mutex_lock(&file->lock);
+    if (!file->partial_write && READ_ONCE(file->dev->partial_write))
+        aesd_partial_adopt(file);
 
-        new_entry.buffptr = new_buf;
-        new_entry.size = new_size;
-        dev->partial_write = NULL;
-        dev->partial_write_size = 0;
-    } else {
-        if (temp_buf[count - 1] != '\n') {
-            dev->partial_write = temp_buf;
-            dev->partial_write_size = count;
-            mutex_unlock(&dev->lock);
-            return count;
+    // A complete write with nothing pending goes straight from user space to where it is kept
+    if (last == '\n' && !file->partial_write_size) {
+        struct aesd_write_buf *wb = NULL;
+
+        // Where a write goes in the byte ring is only known under the lock, so ring mode copies there
+        if (!dev->ring) {
+            retval = aesd_entry_copy(buf, count, &wb);
+            if (retval)
+                goto out;
         }
-        new_entry.buffptr = temp_buf;
-        new_entry.size = count;
+        locked = aesd_lock(dev);
+        if (wb)
+            aesd_entry_commit(dev, wb, count);
+        else
+            retval = aesd_ring_add(dev, buf, NULL, count);
+        aesd_unlock(dev, locked);
+        goto out;
     }
 
-     if (dev->circular_buffer.full)
-        kfree(dev->circular_buffer.entry[dev->circular_buffer.out_offs].buffptr);
-	// clear the buffptr
+    retval = aesd_partial_append(&file->partial_write, &file->partial_write_size, buf, NULL, count);
+    if (retval)
+        goto out;
 
-     aesd_circular_buffer_add_entry(&dev->circular_buffer, &new_entry);
-     retval = count;
+    // write on circular buffer only when terminated with \n
+    if (last == '\n') {
+        locked = aesd_lock(dev);
+        retval = aesd_partial_commit(file, dev);
+        aesd_unlock(dev, locked);
+    }
 
-     mutex_unlock(&dev->lock);
-    
-     return retval;
+out:
+    trace_aesd_write(aesd_dev_minor(dev), count, file->partial_write_size, retval ? retval : (ssize_t)count);
+    aesd_stat_add(dev, write_ops, 1);
+    if (!retval)
+        aesd_stat_add(dev, write_bytes, count);
+    mutex_unlock(&file->lock);
+    return retval ? retval : (ssize_t)count;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
     loff_t new_pos;
-    loff_t total_size = 0;
-    uint8_t i;
+    loff_t total_size;
 
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t base = 0, end = 0;
 
-    mutex_lock(&dev->lock);
-
-    // Calculate the total size of valid data in circular buffer
-    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        total_size += dev->circular_buffer.entry[i].size;
+    // Total size of valid data in circular buffer, kept up to date on every write
+    if (dev->merged) {
+        total_size = aesd_merged_size();
+    } else {
+        aesd_bounds(dev, &base, &end);
+        total_size = end - base;
     }
 
     switch (whence) {
@@ -176,27 +1399,427 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
             new_pos = total_size + offset;
             break;
         default:
-            mutex_unlock(&dev->lock);
-            return -EINVAL;
+            new_pos = -EINVAL;
+            goto out;
     }
 
     if (new_pos < 0 || new_pos > total_size) {
-        mutex_unlock(&dev->lock);
-        return -EINVAL;
+        new_pos = -EINVAL;
+        goto out;
     }
 
     filp->f_pos = new_pos;
+    file->anchor = base;
+out:
+    trace_aesd_seek(aesd_dev_minor(dev), offset, whence, new_pos);
+    return new_pos;
+}
+
+/*
+ * Keep the new_depth most recent writes, freeing the older ones
+ */
+static int aesd_set_depth(struct aesd_dev *dev, u32 new_depth)
+{
+    struct aesd_buffer_entry dropped;
+    int retval;
+
+    mutex_lock(&dev->lock);
+
+    // Free the oldest writes that no longer fit before moving the rest
+    write_seqcount_begin(&dev->seq);
+    while (aesd_circular_buffer_count(&dev->circular_buffer) > new_depth &&
+           aesd_circular_buffer_drop_oldest(&dev->circular_buffer, &dropped)) {
+        aesd_evicted(dev, dev->circular_buffer.out_seq - 1, dropped.size);
+        aesd_retire(dev, &dropped);
+    }
+    write_seqcount_end(&dev->seq);
+    retval = aesd_resize(dev, new_depth);
+    if (dev->ring)
+        aesd_mmap_publish(dev, NULL);
 
     mutex_unlock(&dev->lock);
-    return new_pos;
+    return retval;
 }
 
-long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/*
+ * Batched ioctls: each does what a run of plain calls would, in one
+ * system call and, for writes, one acquisition of the device lock.
+ */
+
+static int aesd_get_iovec(u64 uiov, u32 i, struct aesd_iovec *iov)
+{
+    const struct aesd_iovec __user *uptr = u64_to_user_ptr(uiov);
+
+    return copy_from_user(iov, uptr + i, sizeof(*iov)) ? -EFAULT : 0;
+}
+
+/*
+ * Set up iter over len bytes of user memory at buf for a read to fill, iov
+ * holds the range on kernels before import_ubuf()
+ */
+static int aesd_user_iter(void __user *buf, size_t len, struct iovec *iov, struct iov_iter *iter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    return import_ubuf(ITER_DEST, buf, len, iter);
+#else
+    return import_single_range(READ, buf, len, iov, iter);
+#endif
+}
+
+static long aesd_ioctl_read_cmds(struct file *filp, struct aesd_read_cmds __user *uarg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    struct aesd_read_cmds rc;
+    struct aesd_iovec iov;
+    struct iovec uiov;
+    struct iov_iter iter;
+    size_t start = 0, end = 0, base = 0, pos, want;
+    loff_t f_pos;
+    u64 copied = 0;
+    ssize_t n;
+    unsigned int seq;
+    bool found;
+    u32 i;
+    int idx, retval = 0;
+
+    if (copy_from_user(&rc, uarg, sizeof(rc)))
+        return -EFAULT;
+    if (rc.iovcnt > UIO_MAXIOV)
+        return -EINVAL;
+
+    // The range to read, from write_cmd at write_cmd_offset to the end of the last command asked for
+    if (dev->merged) {
+        retval = aesd_merged_fpos_for_entry(rc.write_cmd, rc.write_cmd_offset, &start);
+        if (retval)
+            return retval;
+        if (rc.cmd_count == 0 || rc.cmd_count > U32_MAX - rc.write_cmd ||
+            aesd_merged_fpos_for_entry(rc.write_cmd + rc.cmd_count, 0, &end))
+            end = aesd_merged_size();
+        end = max(end, start); // Both moved on between the two snapshots
+    } else {
+        idx = srcu_read_lock(&aesd_srcu);
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            base = cb->base_offs;
+            found = aesd_circular_buffer_fpos_for_entry(cb, rc.write_cmd, rc.write_cmd_offset, &start);
+            if (rc.cmd_count == 0 || rc.cmd_count > U32_MAX - rc.write_cmd ||
+                !aesd_circular_buffer_fpos_for_entry(cb, rc.write_cmd + rc.cmd_count, 0, &end))
+                end = aesd_circular_buffer_size(cb);
+        } while (read_seqcount_retry(&dev->seq, seq));
+        srcu_read_unlock(&aesd_srcu, idx);
+        if (!found)
+            return -EINVAL;
+    }
+
+    // Fill the buffers in turn, stopping early if the data is evicted meanwhile
+    f_pos = start;
+    pos = base + start;
+    for (i = 0; i < rc.iovcnt && copied < end - start; i++) {
+        retval = aesd_get_iovec(rc.iov, i, &iov);
+        if (retval)
+            break;
+        want = min_t(u64, iov.len, end - start - copied);
+        if (want == 0)
+            continue;
+        retval = aesd_user_iter(u64_to_user_ptr(iov.base), want, &uiov, &iter);
+        if (retval)
+            break;
+        n = dev->merged ? aesd_merged_read(&iter, want, &f_pos) :
+                          aesd_read_at(dev, &iter, want, &f_pos, &pos, false);
+        if (n < 0) {
+            retval = n;
+            break;
+        }
+        copied += n;
+        if ((size_t)n < want)
+            break;
+    }
+    if (copied)
+        retval = 0; // Report what was copied before a fault, as read does
+
+    filp->f_pos = start + copied;
+    file->anchor = base;
+    if (put_user(copied, &uarg->bytes))
+        return -EFAULT;
+    return retval;
+}
+
+static int aesd_put_entry_info(u64 entries, u32 i, size_t offset, size_t size, u64 seq, size_t start)
+{
+    struct aesd_entry_info __user *uptr = u64_to_user_ptr(entries);
+    struct aesd_entry_info info = { .offset = offset, .size = size, .seq = seq, .start = start };
+
+    return copy_to_user(uptr + i, &info, sizeof(info)) ? -EFAULT : 0;
+}
+
+static long aesd_ioctl_entries(struct aesd_file *file, struct aesd_entry_table __user *uarg)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *cb = &dev->circular_buffer;
+    const struct aesd_buffer_entry *entry;
+    struct aesd_entry_table et;
+    struct aesd_merge *m;
+    size_t *fpos, *size, pos = 0, base = 0;
+    u64 out_seq = 0;
+    unsigned int seq;
+    u32 i, n;
+    int idx, retval = 0;
+
+    if (copy_from_user(&et, uarg, sizeof(et)))
+        return -EFAULT;
+    et.count = 0;
+    et.total_cmds = 0;
+
+    if (dev->merged) {
+        idx = srcu_read_lock(&aesd_srcu);
+        m = aesd_merge_start();
+        if (!m) {
+            srcu_read_unlock(&aesd_srcu, idx);
+            return -ENOMEM;
+        }
+        while ((entry = aesd_merge_next(m))) {
+            if (et.total_cmds >= et.first_cmd && et.count < et.max_entries) {
+                retval = aesd_put_entry_info(et.entries, et.count++, pos, entry->size,
+                                             to_write_buf(entry->buffptr)->seq, 0);
+                if (retval)
+                    break;
+            }
+            et.total_cmds++;
+            pos += entry->size;
+        }
+        et.total_size = pos;
+        aesd_merge_end(m);
+        srcu_read_unlock(&aesd_srcu, idx);
+    } else {
+        // Taken without the lock into a copy first, so the entries are from one moment
+        n = min_t(u32, et.max_entries, READ_ONCE(cb->size_mask) + 1);
+        fpos = kvmalloc_array(max_t(u32, n, 1), 2 * sizeof(*fpos), GFP_KERNEL);
+        if (!fpos)
+            return -ENOMEM;
+        size = fpos + max_t(u32, n, 1);
+
+        idx = srcu_read_lock(&aesd_srcu);
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            base = cb->base_offs;
+            out_seq = cb->out_seq;
+            et.count = aesd_circular_buffer_entry_table(cb, et.first_cmd, n, fpos, size);
+            et.total_cmds = aesd_circular_buffer_count(cb);
+            et.total_size = aesd_circular_buffer_size(cb);
+        } while (read_seqcount_retry(&dev->seq, seq));
+        srcu_read_unlock(&aesd_srcu, idx);
+
+        for (i = 0; i < et.count && !retval; i++)
+            retval = aesd_put_entry_info(et.entries, i, fpos[i], size[i], out_seq + et.first_cmd + i,
+                                         base + fpos[i]);
+        kvfree(fpos);
+    }
+
+    if (retval)
+        return retval;
+    return copy_to_user(uarg, &et, sizeof(et)) ? -EFAULT : 0;
+}
+
+/*
+ * Sequence numbers on the merged view are the ones every per CPU device
+ * stamps its writes with from aesd_seq
+ */
+static int aesd_merged_fpos_for_seq(u64 want, size_t *fpos_rtn, u64 *seq_rtn)
+{
+    const struct aesd_buffer_entry *entry;
+    struct aesd_merge *m;
+    size_t pos = 0;
+    u64 next = atomic64_read(&aesd_seq);
+    int retval = 0, idx;
+
+    idx = srcu_read_lock(&aesd_srcu);
+    m = aesd_merge_start();
+    if (!m) {
+        srcu_read_unlock(&aesd_srcu, idx);
+        return -ENOMEM;
+    }
+    while ((entry = aesd_merge_next(m)) && to_write_buf(entry->buffptr)->seq < want)
+        pos += entry->size;
+
+    if (entry) {
+        *seq_rtn = to_write_buf(entry->buffptr)->seq;
+    } else if (want <= next) {
+        *seq_rtn = next; // Nothing stored from want on, anything before next was overwritten
+    } else {
+        retval = -EINVAL;
+    }
+    *fpos_rtn = pos;
+    aesd_merge_end(m);
+    srcu_read_unlock(&aesd_srcu, idx);
+    return retval;
+}
+
+static long aesd_ioctl_seek_seq(struct file *filp, struct aesd_seekseq __user *uarg)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_seekseq ss;
+    size_t new_pos = 0, base = 0;
+    u64 found_seq = 0;
+    unsigned int seq;
+    bool found;
+    int idx, retval;
+
+    if (copy_from_user(&ss, uarg, sizeof(ss)))
+        return -EFAULT;
+
+    if (dev->merged) {
+        retval = aesd_merged_fpos_for_seq(ss.seq, &new_pos, &found_seq);
+        if (retval)
+            return retval;
+        ss.offset = 0;
+    } else {
+        idx = srcu_read_lock(&aesd_srcu);
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            base = dev->circular_buffer.base_offs;
+            found = aesd_circular_buffer_fpos_for_seq(&dev->circular_buffer, ss.seq, &new_pos, &found_seq);
+        } while (read_seqcount_retry(&dev->seq, seq));
+        srcu_read_unlock(&aesd_srcu, idx);
+        if (!found)
+            return -EINVAL;
+        ss.offset = base + new_pos;
+    }
+
+    ss.lost = found_seq - ss.seq;
+    ss.seq = found_seq;
+    filp->f_pos = new_pos;
+    file->anchor = base;
+    return copy_to_user(uarg, &ss, sizeof(ss)) ? -EFAULT : 0;
+}
+
+/*
+ * Fetch buffer i of an AESDCHAR_IOCWRITELINES call, which must hold one line ending in '\n'
+ */
+static int aesd_get_line(u64 uiov, u32 i, const char __user **line, size_t *len)
+{
+    struct aesd_iovec iov;
+    char last;
+    int retval = aesd_get_iovec(uiov, i, &iov);
+
+    if (retval)
+        return retval;
+    if (iov.len == 0 || iov.len != (size_t)iov.len)
+        return -EINVAL;
+    *line = u64_to_user_ptr(iov.base);
+    *len = iov.len;
+    if (get_user(last, *line + *len - 1))
+        return -EFAULT;
+    return last == '\n' ? 0 : -EINVAL; // Not a complete line
+}
+
+/*
+ * A line of an AESDCHAR_IOCWRITELINES call copied in before the device lock is taken
+ */
+struct aesd_staged_line {
+    struct aesd_write_buf *wb; // NULL for the one completing the file's unfinished line
+    size_t len;
+};
+
+static long aesd_ioctl_write_lines(struct aesd_file *file, struct aesd_write_lines __user *uarg)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_write_lines wl;
+    struct aesd_staged_line *staged = NULL;
+    const char __user *line;
+    size_t len;
+    u32 i, lines = 0;
+    int retval = 0;
+    u64 locked;
+
+    if (copy_from_user(&wl, uarg, sizeof(wl)))
+        return -EFAULT;
+    if (wl.iovcnt > UIO_MAXIOV)
+        return -EINVAL;
+    if (wl.iovcnt == 0)
+        return put_user(0, &uarg->lines) ? -EFAULT : 0;
+    if (dev->merged)
+        dev = aesd_cpu_dev(raw_smp_processor_id());
+    if (!dev->ring) {
+        staged = kvmalloc_array(wl.iovcnt, sizeof(*staged), GFP_KERNEL);
+        if (!staged)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&file->lock);
+    if (!file->partial_write && READ_ONCE(file->dev->partial_write))
+        aesd_partial_adopt(file);
+
+    if (staged) {
+        // Copy every line first, the device lock is only taken once to add them all
+        for (i = 0; i < wl.iovcnt; i++) {
+            retval = aesd_get_line(wl.iov, i, &line, &len);
+            if (retval)
+                break;
+            staged[i].len = len;
+            staged[i].wb = NULL;
+            if (i == 0 && file->partial_write_size)
+                retval = aesd_partial_append(&file->partial_write, &file->partial_write_size,
+                                             line, NULL, len);
+            else
+                retval = aesd_entry_copy(line, len, &staged[i].wb);
+            if (retval)
+                break;
+        }
+
+        // Lines before an error are still stored, as separate writes would have been
+        if (i > 0) {
+            locked = aesd_lock(dev);
+            for (lines = 0; lines < i; lines++) {
+                if (staged[lines].wb)
+                    aesd_entry_commit(dev, staged[lines].wb, staged[lines].len);
+                else
+                    aesd_partial_commit(file, dev);
+            }
+            aesd_unlock(dev, locked);
+        }
+        kvfree(staged);
+    } else {
+        // Where a line goes in the byte ring is only known under the lock, so ring mode copies there
+        locked = aesd_lock(dev);
+        for (i = 0; i < wl.iovcnt; i++) {
+            retval = aesd_get_line(wl.iov, i, &line, &len);
+            if (retval)
+                break;
+            if (!file->partial_write_size) {
+                retval = aesd_ring_add(dev, line, NULL, len);
+            } else {
+                retval = aesd_partial_append(&file->partial_write, &file->partial_write_size,
+                                             line, NULL, len);
+                if (!retval)
+                    retval = aesd_partial_commit(file, dev);
+            }
+            if (retval)
+                break;
+            lines++;
+        }
+        aesd_unlock(dev, locked);
+    }
+    mutex_unlock(&file->lock);
+
+    if (put_user(lines, &uarg->lines))
+        return -EFAULT;
+    return retval;
+}
+
+static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     struct aesd_seekto seekto;
-    loff_t new_pos = 0;
-    uint32_t i;
+    size_t new_pos, base = 0;
+    uint32_t new_depth, tail;
+    unsigned int seq, cpu;
+    long retval = 0;
+    bool found;
+    int idx;
 
     if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
         return -ENOTTY;  // checking magic number, command no.(should be 1)
@@ -206,43 +1829,104 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)))
                 return -EFAULT;
 
-            mutex_lock(&dev->lock);
-
-            if (seekto.write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ||
-                !dev->circular_buffer.entry[(dev->circular_buffer.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].buffptr ||
-                seekto.write_cmd_offset >= dev->circular_buffer.entry[(dev->circular_buffer.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size) {
-                mutex_unlock(&dev->lock);
-                return -EINVAL;   // Offset exceeds total nu. of wrt cmds (or) No data at offset write_cmd (or) exceeding the command size
+            if (dev->merged) {
+                retval = aesd_merged_fpos_for_entry(seekto.write_cmd, seekto.write_cmd_offset, &new_pos);
+                if (retval)
+                    return retval;
+                filp->f_pos = new_pos;
+                break;
             }
 
-            for (i = 0; i < seekto.write_cmd; i++) {
-                new_pos += dev->circular_buffer.entry[(dev->circular_buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
-            }
+            idx = srcu_read_lock(&aesd_srcu);
+            do {
+                seq = read_seqcount_begin(&dev->seq);
+                base = dev->circular_buffer.base_offs;
+                found = aesd_circular_buffer_fpos_for_entry(&dev->circular_buffer, seekto.write_cmd,
+                                                            seekto.write_cmd_offset, &new_pos);
+            } while (read_seqcount_retry(&dev->seq, seq));
+            srcu_read_unlock(&aesd_srcu, idx);
+
+            if (!found)
+                return -EINVAL;   // Offset exceeds total nu. of wrt cmds (or) No data at offset write_cmd (or) exceeding the command size
 
-            new_pos += seekto.write_cmd_offset;
             filp->f_pos = new_pos;
+            file->anchor = base;
+            break;
+        case AESDCHAR_IOCRESIZE:
+            if (copy_from_user(&new_depth, (const void __user *)arg, sizeof(new_depth)))
+                return -EFAULT;
+            if (new_depth == 0 || new_depth > AESDCHAR_MAX_DEPTH)
+                return -EINVAL;
 
-            mutex_unlock(&dev->lock);
+            if (!dev->merged) {
+                retval = aesd_set_depth(dev, new_depth);
+                break;
+            }
+            // Every CPU's device keeps new_depth writes
+            for (cpu = 0; cpu < nr_cpu_ids && !retval; cpu++)
+                retval = aesd_set_depth(aesd_cpu_dev(cpu), new_depth);
+            break;
+        case AESDCHAR_IOCTAIL:
+            if (copy_from_user(&tail, (const void __user *)arg, sizeof(tail)))
+                return -EFAULT;
+            // Merged view positions shift with every CPU's evictions, there is no one place to wait at
+            if (dev->merged)
+                return -EINVAL;
+
+            // Follow on from the current position
+            file->anchor = READ_ONCE(dev->circular_buffer.base_offs);
+            file->tail = tail != 0;
+            break;
+        case AESDCHAR_IOCREADCMDS:
+            retval = aesd_ioctl_read_cmds(filp, (struct aesd_read_cmds __user *)arg);
+            break;
+        case AESDCHAR_IOCENTRIES:
+            retval = aesd_ioctl_entries(file, (struct aesd_entry_table __user *)arg);
+            break;
+        case AESDCHAR_IOCWRITELINES:
+            retval = aesd_ioctl_write_lines(file, (struct aesd_write_lines __user *)arg);
+            break;
+        case AESDCHAR_IOCSEEKSEQ:
+            retval = aesd_ioctl_seek_seq(filp, (struct aesd_seekseq __user *)arg);
             break;
         default:
             return -ENOTTY;
     }
-    return 0;
+    return retval;
+}
+
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *file = filp->private_data;
+    long retval = aesd_ioctl(filp, cmd, arg);
+
+    trace_aesd_ioctl(aesd_dev_minor(file->dev), cmd, filp->f_pos, retval);
+    return retval;
 }
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read, // Lets aesdsocket splice() replies straight from the device
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write =    aesd_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl, // Every argument has the same layout for 32 bit callers
+#endif
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     // cdev init
     cdev_init(&dev->cdev, &aesd_fops); //aesdchar instance and aesd_fops
@@ -253,18 +1937,122 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     // cdev add
     err = cdev_add (&dev->cdev, devno, 1); 
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+/*
+ * Set up the storage of one device. The merged view of per CPU mode has none.
+ */
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    int result;
+
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->wait);
+    INIT_WORK(&dev->seal_work, aesd_seal_work);
+    aesd_circular_buffer_init(&dev->circular_buffer);
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (!dev->stats)
+        return -ENOMEM;
+    if (dev->merged)
+        return 0;
+
+    result = aesd_circular_buffer_resize(&dev->circular_buffer, depth);
+    if (result) {
+        printk(KERN_ERR "aesdchar: invalid depth %u\n", depth);
+        free_percpu(dev->stats);
+        return result;
+    }
+
+    if (compress_block) {
+        dev->seal_src = kmalloc(2 * compress_block, GFP_KERNEL);
+        dev->seal_dst = kmalloc(2 * compress_block, GFP_KERNEL);
+        if (!dev->seal_src || !dev->seal_dst) {
+            kfree(dev->seal_src);
+            kfree(dev->seal_dst);
+            aesd_circular_buffer_free(&dev->circular_buffer);
+            free_percpu(dev->stats);
+            return -ENOMEM;
+        }
+    }
+
+    if (ring_bytes) {
+        size_t header_size = PAGE_ALIGN(sizeof(struct aesd_mmap_header));
+
+        dev->ring_size = roundup_pow_of_two(max_t(ulong, ring_bytes, PAGE_SIZE));
+        // Zeroed and page backed, so it can be mapped to user space as is
+        dev->mmap_header = vmalloc_user(header_size + dev->ring_size);
+        if (!dev->mmap_header) {
+            aesd_circular_buffer_free(&dev->circular_buffer);
+            free_percpu(dev->stats);
+            return -ENOMEM;
+        }
+        dev->ring = (char *)dev->mmap_header + header_size;
+        dev->mmap_header->magic = AESD_MMAP_MAGIC;
+        dev->mmap_header->header_size = header_size;
+        dev->mmap_header->ring_size = dev->ring_size;
+        dev->mmap_header->index_slots = AESD_MMAP_INDEX_SLOTS;
+    }
+    return 0;
+}
+
+/*
+ * Free the writes and storage of one device, with no reader left
+ */
+static void aesd_dev_destroy(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+
+    if (dev->ring) {
+        vfree(dev->mmap_header);
+    } else {
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buffer, index) {
+            if (entry->buffptr && aesd_buf_put(to_write_buf(entry->buffptr)))
+                aesd_buf_free(to_write_buf(entry->buffptr));
+        }
+    }
+    aesd_circular_buffer_free(&dev->circular_buffer);
+    if (dev->partial_write)
+        aesd_buf_free(dev->partial_write);
+    kfree(dev->seal_src);
+    kfree(dev->seal_dst);
+    free_percpu(dev->stats);
+
+    mutex_destroy(&dev->lock);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    unsigned int i;
+
+    if (compress_block && (ring_bytes || percpu)) {
+        printk(KERN_ERR "aesdchar: compress_block needs one buffer per write, not ring_bytes or percpu\n");
+        return -EINVAL;
+    }
+    if (compress_block > AESD_SEAL_MAX_BLOCK) {
+        printk(KERN_ERR "aesdchar: compress_block is at most %u\n", AESD_SEAL_MAX_BLOCK);
+        return -EINVAL;
+    }
+    if (percpu) {
+        if (ring_bytes) {
+            printk(KERN_ERR "aesdchar: percpu needs one buffer per write, not ring_bytes\n");
+            return -EINVAL;
+        }
+        devices = 1 + nr_cpu_ids;
+    }
+    if (devices == 0 || devices > MINORMASK) {
+        printk(KERN_ERR "aesdchar: invalid devices %u\n", devices);
+        return -EINVAL;
+    }
 
     // asks the kernel to reserve a region of device numbers
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    result = alloc_chrdev_region(&dev, aesd_minor, devices,
             "aesdchar");
             
     aesd_major = MAJOR(dev);
@@ -273,32 +2061,94 @@ int aesd_init_module(void)
         return result;
     }
     
-    // initializes aesdc_device structrue declared b4
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+    // initializes the aesdchar devices
+    aesd_devices = kcalloc(devices, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_devices) {
+        unregister_chrdev_region(dev, devices);
+        return -ENOMEM;
+    }
 
-    
-    mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.circular_buffer);
-    
-    result = aesd_setup_cdev(&aesd_device);
+    result = init_srcu_struct(&aesd_srcu);
+    if (result) {
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, devices);
+        return result;
+    }
+
+    result = aesd_buf_caches_create();
+    if (!result && compress_block) {
+        aesd_lz4 = crypto_alloc_acomp("lz4", 0, 0);
+        if (IS_ERR(aesd_lz4)) {
+            printk(KERN_ERR "aesdchar: no lz4 compression for compress_block, is CONFIG_CRYPTO_LZ4 set?\n");
+            result = PTR_ERR(aesd_lz4);
+            aesd_lz4 = NULL;
+            aesd_buf_caches_destroy();
+        }
+    }
+    if (result) {
+        cleanup_srcu_struct(&aesd_srcu);
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, devices);
+        return result;
+    }
+
+    for (aesd_ndevs = 0; aesd_ndevs < devices; aesd_ndevs++) {
+        struct aesd_dev *d = &aesd_devices[aesd_ndevs];
+
+        d->merged = percpu && aesd_ndevs == 0;
+        result = aesd_dev_init(d);
+        if (result)
+            break;
+        result = aesd_setup_cdev(d, aesd_ndevs);
+        if (result) {
+            aesd_dev_destroy(d);
+            break;
+        }
+    }
 
     if( result ) {
-        unregister_chrdev_region(dev, 1);
+        for (i = 0; i < aesd_ndevs; i++) {
+            cdev_del(&aesd_devices[i].cdev);
+            aesd_dev_destroy(&aesd_devices[i]);
+        }
+        cleanup_srcu_struct(&aesd_srcu);
+        aesd_buf_caches_destroy();
+        if (aesd_lz4)
+            crypto_free_acomp(aesd_lz4);
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, devices);
+        return result;
     }
-    return result;
+
+    // Only for looking at, the driver works the same without it
+    aesd_debugfs_create();
+    return 0;
 
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
+
+    debugfs_remove_recursive(aesd_debugfs);
+    for (i = 0; i < aesd_ndevs; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        cancel_work_sync(&aesd_devices[i].seal_work);
+    }
 
-    cdev_del(&aesd_device.cdev);
+    // Let writes already evicted be freed first
+    srcu_barrier(&aesd_srcu);
+    cleanup_srcu_struct(&aesd_srcu);
 
-    mutex_destroy(&aesd_device.lock);
-      
+    for (i = 0; i < aesd_ndevs; i++)
+        aesd_dev_destroy(&aesd_devices[i]);
+    aesd_buf_caches_destroy();
+    if (aesd_lz4)
+        crypto_free_acomp(aesd_lz4);
+    kfree(aesd_devices);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_ndevs);
 }
 
 
@@ -0,0 +1,403 @@
+/*
+ * aesdsocket-bench.c
+ *
+ * Connection count scaling benchmark for aesdsocket.
+ *
+ * For every connection count in the sweep, opens that many concurrent
+ * connections to the server and has each of them send a number of lines one
+ * after another, waiting for its own line to come back in the reply before
+ * sending the next one. Prints one CSV row per connection count with the
+ * connect time, message rate, reply latency percentiles and, when the server
+ * pid is given, the server resident memory and thread count.
+ *
+ * -l sets the line size (the unique token sits at the end of the line, the
+ * rest is padding). -r paces every connection to a fixed message rate; the
+ * latency is then measured from the time a message was due rather than the
+ * time it went out, so a slow server can not hide its queueing delay by
+ * slowing the benchmark down. -k sends the given percentage of messages as an
+ * AESDCHAR_IOCSEEKTO command (position set with -K) pipelined with the line,
+ * and the message completes when the line comes back after the seek reply.
+ * Against a server without the char device the seek gets no reply, so only
+ * the line is measured.
+ *
+ * The server keeps appending to the same data file, so full file replies grow
+ * over the sweep. Restart the server between runs when comparing modes, or
+ * pass -T to have every connection negotiate incremental (tail) replies.
+ *
+ * -P prefills the data file with one line of the given size in kB before the
+ * sweep, which turns the sweep into a reply throughput test for large files
+ * (compare a server started with and without -C for copy vs zero copy).
+ *
+ * Usage: aesdsocket-bench [-H host] [-p port] [-c conns[,conns...]] [-m msgs] [-l line_bytes]
+ *                         [-r msgs_per_sec] [-k seek_pct] [-K cmd,offset] [-s server_pid] [-T] [-P prefill_kb]
+ */
+
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define TOKEN_FMT "bench%06d-%06d\n" // Fixed width so one token never matches inside another
+#define TOKEN_LEN 19
+#define PAD_CHAR '.' // Line padding, never part of a token
+#define TIMEOUT_MS 10000 // Give up if no reply makes progress for this long
+
+struct client {
+    int fd;
+    int id;
+    int seq; // Index of the message waiting for its reply
+    int done;
+    int waiting; // A message is out and its reply not yet seen
+    double due_at; // When the next message should go out with -r
+    char token[TOKEN_LEN + 1]; // Line we are waiting to see in the reply
+    char tail[TOKEN_LEN]; // End of the previous chunk, a token may straddle two recvs
+    size_t tail_len;
+    double sent_at;
+};
+
+static const char *host = "127.0.0.1";
+static const char *port = "9000";
+static int msgs_per_conn = 5;
+static int server_pid = 0;
+static int tail_mode = 0; // Ask the server for AESDSOCKET_REPLY:TAIL
+static long prefill_kb = 0;
+static int line_bytes = TOKEN_LEN;
+static double rate = 0; // Messages per second per connection, 0 sends back to back
+static int seek_pct = 0;
+static const char *seek_pos = "0,0";
+static char *msg_buf; // Seek command, then the line: padding followed by the token slot
+static char *line_buf; // The line inside msg_buf
+static size_t seek_cmd_len;
+static unsigned int rand_state = 1;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t idx = (size_t)(p * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+// Read VmRSS (kB) and Threads from /proc/<pid>/status
+static void server_usage(long *rss_kb, long *threads) {
+    char path[64], line[256];
+    FILE *f;
+
+    *rss_kb = *threads = -1;
+    if (!server_pid) return;
+    snprintf(path, sizeof(path), "/proc/%d/status", server_pid);
+    f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %ld", rss_kb);
+        sscanf(line, "Threads: %ld", threads);
+    }
+    fclose(f);
+}
+
+static int connect_one(const struct addrinfo *res) {
+    static const char tail_cmd[] = "AESDSOCKET_REPLY:TAIL\n";
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == -1) return -1;
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == -1 ||
+        (tail_mode && send(fd, tail_cmd, sizeof(tail_cmd) - 1, MSG_NOSIGNAL) == -1)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Store one prefill_kb sized line, then drain the reply until the server closes
+static int prefill(const struct addrinfo *res) {
+    size_t len = (size_t)prefill_kb * 1024, off = 0;
+    char *line = malloc(len);
+    static char buf[65536];
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int ret = -1;
+
+    if (!line || fd == -1 || connect(fd, res->ai_addr, res->ai_addrlen) == -1) goto out;
+    memset(line, 'p', len - 1);
+    line[len - 1] = '\n';
+    while (off < len) {
+        ssize_t n = send(fd, line + off, len - off, MSG_NOSIGNAL);
+        if (n == -1) goto out;
+        off += n;
+    }
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, buf, sizeof(buf), 0) > 0) {
+    }
+    ret = 0;
+out:
+    if (fd != -1) close(fd);
+    free(line);
+    return ret;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+// Send the next message, a seek command first for seek_pct percent of them
+static int send_next(struct client *c, int *seeks) {
+    snprintf(c->token, sizeof(c->token), TOKEN_FMT, c->id, c->seq);
+    memcpy(line_buf + line_bytes - TOKEN_LEN, c->token, TOKEN_LEN);
+    // Paced messages count from when they were due
+    c->sent_at = rate > 0 ? c->due_at : now_us();
+    c->waiting = 1;
+    // One send for both, so Nagle does not hold the line back behind the command
+    if (seek_pct > 0 && (int)(rand_r(&rand_state) % 100) < seek_pct) {
+        (*seeks)++;
+        return send_all(c->fd, msg_buf, seek_cmd_len + line_bytes);
+    }
+    return send_all(c->fd, line_buf, line_bytes);
+}
+
+// Scan newly received bytes for the awaited token, returns 1 if it was seen
+static int scan_reply(struct client *c, const char *data, size_t len) {
+    char window[TOKEN_LEN * 2];
+    size_t head = len < TOKEN_LEN ? len : TOKEN_LEN;
+    int found;
+
+    // Check the seam between the previous chunk and this one, then the chunk itself
+    memcpy(window, c->tail, c->tail_len);
+    memcpy(window + c->tail_len, data, head);
+    found = memmem(window, c->tail_len + head, c->token, TOKEN_LEN) != NULL ||
+            memmem(data, len, c->token, TOKEN_LEN) != NULL;
+
+    if (len >= TOKEN_LEN - 1) {
+        c->tail_len = TOKEN_LEN - 1;
+        memcpy(c->tail, data + len - c->tail_len, c->tail_len);
+    } else {
+        size_t keep = c->tail_len + len > TOKEN_LEN - 1 ? TOKEN_LEN - 1 - len : c->tail_len;
+        memmove(c->tail, c->tail + c->tail_len - keep, keep);
+        memcpy(c->tail + keep, data, len);
+        c->tail_len = keep + len;
+    }
+    if (found) c->tail_len = 0; // Bytes before our own line can not start the next token
+    return found;
+}
+
+static int run(const struct addrinfo *res, int nconns) {
+    struct client *clients = calloc(nconns, sizeof(*clients));
+    double *latencies = calloc((size_t)nconns * msgs_per_conn, sizeof(double));
+    size_t nlat = 0;
+    int seeks = 0, idle = 0; // idle: paced connections waiting for their next due time
+    unsigned long long bytes_in = 0;
+    static char buf[65536];
+    int epfd = epoll_create1(0);
+    int remaining = nconns, connected = 0, ret = -1;
+    long rss_kb, threads;
+
+    if (!clients || !latencies || epfd == -1) {
+        fprintf(stderr, "setup failed\n");
+        goto out;
+    }
+
+    double t0 = now_us();
+    for (int i = 0; i < nconns; i++) {
+        clients[i].fd = connect_one(res);
+        if (clients[i].fd == -1) {
+            fprintf(stderr, "connect %d failed: %s\n", i, strerror(errno));
+            goto out;
+        }
+        clients[i].id = i;
+        connected++;
+    }
+    double connect_ms = (now_us() - t0) / 1000;
+
+    double start = now_us();
+    for (int i = 0; i < nconns; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &clients[i] };
+        fcntl(clients[i].fd, F_SETFL, O_NONBLOCK);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+        // Spread paced connections over one interval instead of starting in lock step
+        clients[i].due_at = rate > 0 ? start + 1e6 / rate * i / nconns : start;
+        if (clients[i].due_at > start) {
+            idle++;
+        } else if (send_next(&clients[i], &seeks) == -1) {
+            fprintf(stderr, "send failed: %s\n", strerror(errno));
+            goto out;
+        }
+    }
+
+    double last_progress = now_us();
+    while (remaining > 0) {
+        struct epoll_event events[256];
+        int timeout = 100;
+
+        if (idle > 0) {
+            // Send whatever is due, then sleep until the next due time at most
+            double now = now_us(), next = now + timeout * 1000.0;
+            for (int i = 0; i < nconns; i++) {
+                struct client *c = &clients[i];
+                if (c->done || c->waiting) continue;
+                if (c->due_at <= now) {
+                    idle--;
+                    if (send_next(c, &seeks) == -1) {
+                        fprintf(stderr, "send failed: %s\n", strerror(errno));
+                        goto out;
+                    }
+                    last_progress = now; // Waiting on our own schedule is not a stall
+                } else if (c->due_at < next) {
+                    next = c->due_at;
+                }
+            }
+            timeout = (int)((next - now) / 1000);
+        }
+
+        int n = epoll_wait(epfd, events, 256, timeout);
+        if (n == -1 && errno != EINTR) break;
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            ssize_t got = recv(c->fd, buf, sizeof(buf), 0);
+            if (got <= 0) {
+                if (got == -1 && errno == EAGAIN) continue;
+                fprintf(stderr, "connection %d closed by server\n", c->id);
+                goto out;
+            }
+            bytes_in += got;
+            last_progress = now_us();
+            if (c->done || !scan_reply(c, buf, got)) continue;
+
+            latencies[nlat++] = now_us() - c->sent_at;
+            c->waiting = 0;
+            if (++c->seq == msgs_per_conn) {
+                c->done = 1;
+                remaining--;
+            } else if (rate > 0) {
+                c->due_at += 1e6 / rate;
+                idle++;
+            } else if (send_next(c, &seeks) == -1) {
+                fprintf(stderr, "send failed: %s\n", strerror(errno));
+                goto out;
+            }
+        }
+        if (now_us() - last_progress > TIMEOUT_MS * 1000.0) {
+            fprintf(stderr, "timed out with %d connections still waiting\n", remaining);
+            goto out;
+        }
+    }
+    double elapsed_ms = (now_us() - start) / 1000;
+
+    // Sample the server while every connection is still open
+    server_usage(&rss_kb, &threads);
+
+    qsort(latencies, nlat, sizeof(double), cmp_double);
+    printf("%d,%d,%d,%.0f,%d,%.1f,%.1f,%.0f,%llu,%.1f,%.0f,%.0f,%.0f,%.0f,%ld,%ld\n",
+           nconns, msgs_per_conn, line_bytes, rate, seeks, connect_ms, elapsed_ms, nlat / (elapsed_ms / 1000),
+           bytes_in, bytes_in / (elapsed_ms * 1000), percentile(latencies, nlat, 0.50), percentile(latencies, nlat, 0.99),
+           percentile(latencies, nlat, 0.999), latencies[nlat - 1], rss_kb, threads);
+    fflush(stdout);
+    ret = 0;
+
+out:
+    for (int i = 0; i < connected; i++) close(clients[i].fd);
+    if (epfd != -1) close(epfd);
+    free(clients);
+    free(latencies);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    char default_conns[] = "1,10,100,1000";
+    char *conn_list = default_conns;
+    struct addrinfo hints, *res;
+    struct rlimit rl;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:m:l:r:k:K:s:TP:")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': conn_list = optarg; break;
+            case 'm': msgs_per_conn = atoi(optarg); break;
+            case 'l': line_bytes = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'k': seek_pct = atoi(optarg); break;
+            case 'K': seek_pos = optarg; break;
+            case 's': server_pid = atoi(optarg); break;
+            case 'T': tail_mode = 1; break;
+            case 'P': prefill_kb = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-H host] [-p port] [-c conns[,conns...]] [-m msgs] [-l line_bytes]\n"
+                        "       [-r msgs_per_sec] [-k seek_pct] [-K cmd,offset] [-s server_pid] [-T] [-P prefill_kb]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (msgs_per_conn < 1) msgs_per_conn = 1;
+    if (line_bytes < TOKEN_LEN) line_bytes = TOKEN_LEN;
+    if (seek_pct > 100) seek_pct = 100;
+
+    seek_cmd_len = strlen("AESDCHAR_IOCSEEKTO:") + strlen(seek_pos) + 1;
+    msg_buf = malloc(seek_cmd_len + 1 + line_bytes);
+    if (!msg_buf) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    sprintf(msg_buf, "AESDCHAR_IOCSEEKTO:%s\n", seek_pos);
+    line_buf = msg_buf + seek_cmd_len;
+    memset(line_buf, PAD_CHAR, line_bytes);
+
+    // Each connection needs a descriptor on our side as well
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "getaddrinfo failed for %s:%s\n", host, port);
+        return EXIT_FAILURE;
+    }
+
+    if (prefill_kb > 0 && prefill(res) == -1) {
+        fprintf(stderr, "prefill failed: %s\n", strerror(errno));
+        freeaddrinfo(res);
+        free(msg_buf);
+        return EXIT_FAILURE;
+    }
+
+    printf("conns,msgs_per_conn,line_bytes,rate,seek_msgs,connect_ms,elapsed_ms,msgs_per_sec,bytes_in,mb_per_sec,"
+           "p50_us,p99_us,p999_us,max_us,server_rss_kb,server_threads\n");
+    for (char *tok = strtok(conn_list, ","); tok; tok = strtok(NULL, ",")) {
+        int nconns = atoi(tok);
+        if (nconns > 0 && run(res, nconns) == -1) {
+            freeaddrinfo(res);
+            free(msg_buf);
+            return EXIT_FAILURE;
+        }
+    }
+
+    freeaddrinfo(res);
+    free(msg_buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*
+ * aesdsocket-datalog-bench.c
+ *
+ * Contention benchmark for the aesdsocket data file: N reader threads stream
+ * the whole file over and over (like full file replies) while M writer
+ * threads append lines (like client messages).
+ *
+ * -L datalog measures the server scheme from aesdsocket-datalog.c, group
+ * committed appends on a persistent descriptor and readers working lock free
+ * on a published length. -g and -F set its commit window and fsync policy.
+ * -L mutex measures the old scheme, where every reader and writer takes one
+ * global mutex around its whole file access.
+ *
+ * Prints one CSV row: lock,readers,writers,seconds,reads_per_sec,read_mb_per_sec,
+ * appends_per_sec,append_p50_us,append_p99_us
+ *
+ * Usage: aesdsocket-datalog-bench [-r readers] [-w writers] [-d seconds]
+ *                                 [-l line_bytes] [-L datalog|mutex] [-f path]
+ *                                 [-g group_window_us] [-F none|batch|interval_ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+
+#define MAX_SAMPLES 200000 // Append latencies kept per writer
+
+static int use_mutex = 0;
+static int line_bytes = 64;
+static const char *path = "/tmp/aesdsocket-datalog-bench.dat";
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int stop;
+static atomic_ullong reads, read_bytes;
+
+struct writer {
+    pthread_t thread;
+    double *lat;
+    size_t nlat;
+};
+
+// The data log reports its append waits, not measured by the server statistics here
+unsigned long long stats_now_ns(void) {
+    return 0;
+}
+
+void stats_append_wait(unsigned long long ns) {
+    (void)ns;
+}
+
+// No signals to keep away from the flusher thread here
+int create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg) {
+    return pthread_create(thread, NULL, start_routine, arg);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The pre-change append: global lock held around open/write/close
+static void mutex_append(const char *line, size_t len) {
+    pthread_mutex_lock(&global_mutex);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd != -1) {
+        if (write(fd, line, len) == -1) perror("write");
+        close(fd);
+    }
+    pthread_mutex_unlock(&global_mutex);
+}
+
+static void *writer_run(void *arg) {
+    struct writer *w = arg;
+    char *line = malloc(line_bytes);
+
+    memset(line, 'w', line_bytes - 1);
+    line[line_bytes - 1] = '\n';
+    while (!atomic_load(&stop)) {
+        double t = now_us();
+        if (use_mutex) {
+            mutex_append(line, line_bytes);
+        } else {
+            datalog_append(line, line_bytes);
+        }
+        if (w->nlat < MAX_SAMPLES) w->lat[w->nlat++] = now_us() - t;
+    }
+    free(line);
+    return NULL;
+}
+
+static void *reader_run(void *arg) {
+    static __thread char buf[65536];
+    (void)arg;
+
+    while (!atomic_load(&stop)) {
+        unsigned long long got = 0;
+
+        if (use_mutex) pthread_mutex_lock(&global_mutex);
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            // Lock free readers stop at the published length, the mutex reader at EOF
+            off_t left = use_mutex ? -1 : datalog_length();
+            ssize_t n;
+            while (left != 0 && (n = read(fd, buf, (left > 0 && left < (off_t)sizeof(buf)) ? (size_t)left : sizeof(buf))) > 0) {
+                got += n;
+                if (left > 0) left -= n;
+            }
+            close(fd);
+        }
+        if (use_mutex) pthread_mutex_unlock(&global_mutex);
+
+        atomic_fetch_add(&reads, 1);
+        atomic_fetch_add(&read_bytes, got);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nreaders = 4, nwriters = 4, seconds = 2, opt;
+
+    while ((opt = getopt(argc, argv, "r:w:d:l:L:f:g:F:")) != -1) {
+        switch (opt) {
+            case 'r': nreaders = atoi(optarg); break;
+            case 'w': nwriters = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'l': line_bytes = atoi(optarg); break;
+            case 'L': use_mutex = strcmp(optarg, "mutex") == 0; break;
+            case 'f': path = optarg; break;
+            case 'g': datalog_config.group_window_us = atoi(optarg); break;
+            case 'F':
+                if (strcmp(optarg, "none") == 0) {
+                    datalog_config.sync = DATALOG_SYNC_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    datalog_config.sync = DATALOG_SYNC_BATCH;
+                } else {
+                    datalog_config.sync = DATALOG_SYNC_INTERVAL;
+                    datalog_config.sync_interval_ms = atoi(optarg);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r readers] [-w writers] [-d seconds] [-l line_bytes] [-L datalog|mutex] [-f path] [-g group_window_us] [-F none|batch|interval_ms]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (line_bytes < 2) line_bytes = 2;
+
+    unlink(path);
+    datalog_init(path);
+
+    pthread_t *readers = calloc(nreaders, sizeof(*readers));
+    struct writer *writers = calloc(nwriters, sizeof(*writers));
+    for (int i = 0; i < nwriters; i++) {
+        writers[i].lat = malloc(MAX_SAMPLES * sizeof(double));
+        pthread_create(&writers[i].thread, NULL, writer_run, &writers[i]);
+    }
+    for (int i = 0; i < nreaders; i++) {
+        pthread_create(&readers[i], NULL, reader_run, NULL);
+    }
+
+    double start = now_us();
+    sleep(seconds);
+    atomic_store(&stop, 1);
+    for (int i = 0; i < nreaders; i++) pthread_join(readers[i], NULL);
+    for (int i = 0; i < nwriters; i++) pthread_join(writers[i].thread, NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    size_t nlat = 0;
+    for (int i = 0; i < nwriters; i++) nlat += writers[i].nlat;
+    double *lat = malloc((nlat ? nlat : 1) * sizeof(double));
+    nlat = 0;
+    for (int i = 0; i < nwriters; i++) {
+        memcpy(lat + nlat, writers[i].lat, writers[i].nlat * sizeof(double));
+        nlat += writers[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(double), cmp_double);
+
+    printf("lock,readers,writers,seconds,reads_per_sec,read_mb_per_sec,appends_per_sec,append_p50_us,append_p99_us\n");
+    printf("%s,%d,%d,%.2f,%.0f,%.1f,%.0f,%.1f,%.1f\n", use_mutex ? "mutex" : "datalog",
+           nreaders, nwriters, elapsed, atomic_load(&reads) / elapsed,
+           atomic_load(&read_bytes) / elapsed / 1e6, nlat / elapsed,
+           nlat ? lat[nlat / 2] : 0, nlat ? lat[(size_t)(nlat * 0.99)] : 0);
+
+    datalog_destroy();
+    unlink(path);
+    return EXIT_SUCCESS;
+}
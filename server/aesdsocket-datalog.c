@@ -0,0 +1,288 @@
+/*
+ * aesdsocket-datalog.c
+ *
+ * Append side of the aesdsocket data file.
+ *
+ * The file is opened once and kept open for the life of the server. Appends
+ * (client lines and timestamps) are group committed: a thread that finds no
+ * commit in progress becomes the leader, optionally waits a short window for
+ * more appends, and writes everything queued with one writev(). Threads that
+ * arrive while a commit is running queue up for the next one and sleep until
+ * their data is in the file. The data file can be fsync'ed never, after each
+ * batch, or by a flusher thread once per interval while new data came in, so
+ * nothing stays unsynced much longer than the interval even when appends stop.
+ *
+ * After each batch the new file length is published with a release store,
+ * and readers only ever look at bytes below a length they loaded with an
+ * acquire load. The file is append-only, so everything below a published
+ * length is stable and replies need no lock at all.
+ *
+ * For /dev/aesdchar the published length is not used, the driver keeps its
+ * own lock over the history. writev() on the driver still hands it one write
+ * per line, so every line stays a separate entry.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+
+#define MAX_BATCH 1024 // Appends written by one writev(), the usual IOV_MAX
+
+// An append waiting for a group commit, lives on the caller's stack
+struct append_req {
+    const char *buf;
+    size_t len;
+    off_t end; // Data length after this append, -1 if it failed
+    int done;
+    struct append_req *next;
+};
+
+struct datalog_config datalog_config = {
+    .group_window_us = 0,
+    .sync = DATALOG_SYNC_NONE,
+    .sync_interval_ms = 1000,
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the queue and leader flag
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static struct append_req *queue_head;
+static struct append_req **queue_tail = &queue_head;
+static int leader_active; // A commit is being written
+
+static _Atomic off_t committed_len; // Length readers may use
+static const char *log_path;
+static int log_fd = -1; // Long lived append descriptor, only used by the leader
+static int log_is_regular; // fsync only makes sense for a regular file
+
+// Interval sync, the flusher thread only runs with DATALOG_SYNC_INTERVAL
+static pthread_t flusher_thread;
+static int flusher_started;
+static int flusher_stop; // Protected by flush_lock
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wake; // Signalled on shutdown, waits use CLOCK_MONOTONIC
+static off_t synced_len; // Data length at the last fdatasync(), only used by the flusher
+
+static int datalog_open(void) {
+    struct stat st;
+
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (log_fd == -1) {
+        syslog(LOG_ERR, "Failed to open %s for writing: %s", log_path, strerror(errno));
+        return -1;
+    }
+    log_is_regular = fstat(log_fd, &st) == 0 && S_ISREG(st.st_mode);
+    return 0;
+}
+
+// Sync the data file every sync_interval_ms if anything was committed since the last time
+static void *flusher_run(void *arg) {
+    struct timespec deadline;
+    (void)arg;
+
+    pthread_mutex_lock(&flush_lock);
+    while (!flusher_stop) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += datalog_config.sync_interval_ms / 1000;
+        deadline.tv_nsec += (datalog_config.sync_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!flusher_stop && pthread_cond_timedwait(&flush_wake, &flush_lock, &deadline) != ETIMEDOUT) {
+        }
+        if (flusher_stop) break;
+
+        // The leader opened log_fd before it published any length past the initial one
+        off_t len = datalog_length();
+        if (len == synced_len || !log_is_regular) continue;
+        pthread_mutex_unlock(&flush_lock);
+        if (fdatasync(log_fd) == -1) {
+            syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+        }
+        pthread_mutex_lock(&flush_lock);
+        synced_len = len;
+    }
+    pthread_mutex_unlock(&flush_lock);
+    return NULL;
+}
+
+/*
+ * Start appending to path, picking up the length of any existing data.
+ * A device that is not there yet is opened again on the first append.
+ */
+void datalog_init(const char *path) {
+    struct stat st;
+    pthread_condattr_t attr;
+
+    log_path = path;
+    atomic_store(&committed_len, (stat(path, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0);
+    datalog_open();
+
+    if (datalog_config.sync == DATALOG_SYNC_INTERVAL) {
+        if (datalog_config.sync_interval_ms < 1) datalog_config.sync_interval_ms = 1;
+        synced_len = datalog_length();
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&flush_wake, &attr);
+        pthread_condattr_destroy(&attr);
+        if (create_thread(&flusher_thread, flusher_run, NULL) != 0) {
+            syslog(LOG_ERR, "Failed to create flusher thread, syncing after every batch instead");
+            datalog_config.sync = DATALOG_SYNC_BATCH;
+            pthread_cond_destroy(&flush_wake);
+        } else {
+            flusher_started = 1;
+        }
+    }
+}
+
+void datalog_destroy(void) {
+    if (flusher_started) {
+        pthread_mutex_lock(&flush_lock);
+        flusher_stop = 1;
+        pthread_cond_signal(&flush_wake);
+        pthread_mutex_unlock(&flush_lock);
+        pthread_join(flusher_thread, NULL);
+        pthread_cond_destroy(&flush_wake);
+        flusher_started = 0;
+    }
+    if (log_fd != -1) {
+        if (log_is_regular && datalog_config.sync != DATALOG_SYNC_NONE) fdatasync(log_fd);
+        close(log_fd);
+        log_fd = -1;
+    }
+    pthread_cond_destroy(&commit_done);
+    pthread_mutex_destroy(&queue_lock);
+    pthread_mutex_destroy(&flush_lock);
+}
+
+// Apply the fsync policy after a batch has been written, interval syncs are left to the flusher
+static void datalog_sync(void) {
+    if (!log_is_regular || datalog_config.sync != DATALOG_SYNC_BATCH) return;
+    if (fdatasync(log_fd) == -1) {
+        syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+    }
+}
+
+// Write a batch with as few writev() calls as possible, returns the bytes written
+static size_t write_batch(struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+
+    if (log_fd == -1 && datalog_open() == -1) return 0;
+
+    while (iovcnt > 0) {
+        ssize_t ret = writev(log_fd, iov, iovcnt);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "write failed: %s", strerror(errno));
+            break;
+        }
+        total += ret;
+
+        // Skip what was written, a short write can end inside an element
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return total;
+}
+
+// Write out the queued appends as the leader, called and returns with queue_lock held
+static void commit_batch(void) {
+    struct iovec iov[MAX_BATCH];
+    struct append_req *batch, *req, *next;
+    int count = 0, i;
+
+    if (datalog_config.group_window_us > 0) {
+        // Give concurrent appends a moment to join this batch
+        struct timespec window = { 0, datalog_config.group_window_us * 1000L };
+        pthread_mutex_unlock(&queue_lock);
+        nanosleep(&window, NULL);
+        pthread_mutex_lock(&queue_lock);
+    }
+
+    batch = queue_head;
+    for (req = batch; req && count < MAX_BATCH; req = req->next) {
+        iov[count].iov_base = (void *)req->buf;
+        iov[count].iov_len = req->len;
+        count++;
+    }
+    // Anything beyond MAX_BATCH stays queued for the next leader
+    queue_head = req;
+    if (!queue_head) queue_tail = &queue_head;
+    pthread_mutex_unlock(&queue_lock);
+
+    size_t written = write_batch(iov, count);
+    datalog_sync();
+
+    // Hand every append its own end offset, appends cut off by an error fail
+    off_t end = atomic_load_explicit(&committed_len, memory_order_relaxed);
+    size_t left = written;
+    for (i = 0, req = batch; i < count; i++, req = req->next) {
+        if (left >= req->len) {
+            left -= req->len;
+            end += req->len;
+            req->end = end;
+        } else {
+            end += left; // Partial line, keep the length in step with the file
+            left = 0;
+            req->end = -1;
+        }
+    }
+    // Publish only after the data is in the file, readers rely on that order
+    atomic_store_explicit(&committed_len, end, memory_order_release);
+
+    pthread_mutex_lock(&queue_lock);
+    for (i = 0, req = batch; i < count; i++, req = next) {
+        next = req->next;
+        req->done = 1;
+    }
+}
+
+/*
+ * Append len bytes as one unit and wait until they are written.
+ * Returns the data length right after this append, which is the snapshot a
+ * reply to this line should cover, or -1 if the write failed.
+ */
+off_t datalog_append(const char *buf, size_t len) {
+    struct append_req req = { .buf = buf, .len = len, .end = -1 };
+    unsigned long long start_ns = stats_now_ns();
+
+    pthread_mutex_lock(&queue_lock);
+    *queue_tail = &req;
+    queue_tail = &req.next;
+
+    while (!req.done) {
+        if (!leader_active) {
+            leader_active = 1;
+            commit_batch();
+            leader_active = 0;
+            pthread_cond_broadcast(&commit_done);
+        } else {
+            pthread_cond_wait(&commit_done, &queue_lock);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    stats_append_wait(stats_now_ns() - start_ns);
+    return req.end;
+}
+
+// Length of the data that is completely written, safe to read without locking
+off_t datalog_length(void) {
+    return atomic_load_explicit(&committed_len, memory_order_acquire);
+}
@@ -0,0 +1,311 @@
+/*
+ * aesdsocket-epoll.c
+ *
+ * Event driven server mode for aesdsocket (-e). A fixed number of event loop
+ * threads each own an epoll instance and a set of non-blocking client
+ * connections. Every connection is a small state machine: it reads until a
+ * complete line is buffered, then streams the reply for that line before it
+ * looks at the next one. The line protocol is the same as the thread per
+ * connection mode, since both go through process_line().
+ *
+ * process_line() appends to the data file on the loop thread. That waits
+ * for a writev() (and an fdatasync() with -f batch), possibly one another
+ * loop is leading, but never for a group commit window: -g is refused in
+ * this mode.
+ */
+
+#define _GNU_SOURCE // pipe2
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+
+#define MAX_EVENTS 64  // Events handled per epoll_wait() call
+
+enum conn_state {
+    CONN_READING,  // Waiting for a complete line
+    CONN_REPLYING  // Streaming the reply for the last line
+};
+
+// Per connection state, only ever touched by the owning event loop
+struct conn {
+    int fd; // Client socket file descriptor
+    enum conn_state state;
+    int peer_closed; // Client shut down its sending side
+    unsigned long long line_start_ns; // When the line being answered was taken
+    uint32_t events; // Events currently registered with epoll
+    struct client_state cs;
+
+    struct line_framer framer; // Received bytes not yet processed
+
+    struct reply_stream reply; // Reply for the last line, while CONN_REPLYING
+
+    LIST_ENTRY(conn) entries;
+};
+
+struct event_loop {
+    pthread_t thread;
+    int epfd;
+    int handoff[2]; // Pipe the accept thread uses to pass new client sockets
+    LIST_HEAD(conn_list, conn) conns;
+};
+
+static struct event_loop *loops;
+static int num_loops;
+static unsigned int next_loop; // Round robin position, only used by the accept thread
+
+// Update the epoll interest set of a connection if it changed
+static int conn_watch(struct event_loop *loop, struct conn *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+
+    if (c->events == events) return 0;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+static void conn_open(struct event_loop *loop, int client_fd) {
+    struct conn *c;
+    int flags = fcntl(client_fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "Failed to make client socket non-blocking");
+        close(client_fd);
+        return;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        close(client_fd);
+        return;
+    }
+    c->fd = client_fd;
+    c->state = CONN_READING;
+    c->events = EPOLLIN;
+    framer_init(&c->framer);
+    reply_stream_init(&c->reply);
+    client_state_init(&c->cs);
+
+    struct epoll_event ev = { .events = c->events, .data.ptr = c };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        close(client_fd);
+        free(c);
+        return;
+    }
+    LIST_INSERT_HEAD(&loop->conns, c, entries);
+    stats_conn_opened();
+}
+
+static void conn_close(struct event_loop *loop, struct conn *c) {
+    LIST_REMOVE(c, entries);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->reply.file_fd != -1) close(c->reply.file_fd);
+    reply_stream_destroy(&c->reply);
+    framer_destroy(&c->framer);
+    free(c);
+    stats_conn_closed();
+}
+
+// Receive whatever is available, returns -1 if the connection failed
+static int conn_on_readable(struct conn *c) {
+    size_t space;
+    char *dst = framer_recv_space(&c->framer, &space);
+    if (!dst) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+
+    // One recv per wakeup keeps busy clients from starving the others,
+    // epoll is level triggered so we get called again if more is pending
+    ssize_t n = recv(c->fd, dst, space, 0);
+    if (n > 0) {
+        framer_commit(&c->framer, n);
+    } else if (n == 0) {
+        c->peer_closed = 1;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        syslog(LOG_ERR, "Receive failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drive the connection state machine as far as it can go without blocking.
+ * Returns -1 if the connection should be closed.
+ */
+static int conn_advance(struct event_loop *loop, struct conn *c) {
+    for (;;) {
+        if (c->state == CONN_REPLYING) {
+            int ret = reply_stream_flush(&c->reply, c->fd);
+            if (ret == -1) return -1;
+            if (ret == 0) return conn_watch(loop, c, EPOLLOUT);
+            finish_reply(&c->cs, c->reply.file_fd);
+            c->reply.file_fd = -1;
+            c->state = CONN_READING;
+            stats_line_done(c->line_start_ns);
+        }
+
+        // Take the next complete line, there may be several buffered
+        size_t line_len;
+        const char *line = framer_next_line(&c->framer, &line_len);
+        if (!line) {
+            if (c->peer_closed) return -1; // Nothing more will arrive
+            return conn_watch(loop, c, EPOLLIN);
+        }
+
+        c->line_start_ns = stats_now_ns();
+        stats_line_in(line_len);
+
+        off_t reply_len;
+        int file_fd = process_line(&c->cs, line, line_len, &reply_len);
+
+        if (file_fd == LINE_ERROR) return -1;
+        if (file_fd == LINE_NO_REPLY) {
+            stats_line_done(c->line_start_ns);
+            continue;
+        }
+
+        reply_stream_start(&c->reply, file_fd, reply_len);
+        c->state = CONN_REPLYING;
+    }
+}
+
+// Pick up client sockets passed in by the accept thread, returns 0 on shutdown
+static int loop_take_clients(struct event_loop *loop) {
+    int fds[64];
+    ssize_t n;
+
+    while ((n = read(loop->handoff[0], fds, sizeof(fds))) > 0) {
+        for (size_t i = 0; i < n / sizeof(int); i++) {
+            conn_open(loop, fds[i]);
+        }
+    }
+    if (n == 0) return 0; // Write end closed by epoll_server_stop()
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        syslog(LOG_ERR, "Event loop handoff failed: %s", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static void *event_loop_run(void *arg) {
+    struct event_loop *loop = (struct event_loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int running = 1;
+
+    while (running) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+
+            if (!c) { // The handoff pipe
+                running = loop_take_clients(loop);
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR) {
+                conn_close(loop, c);
+                continue;
+            }
+            if (c->state == CONN_READING && conn_on_readable(c) == -1) {
+                conn_close(loop, c);
+                continue;
+            }
+            if (conn_advance(loop, c) == -1) {
+                conn_close(loop, c);
+            }
+        }
+    }
+
+    while (!LIST_EMPTY(&loop->conns)) {
+        conn_close(loop, LIST_FIRST(&loop->conns));
+    }
+    return NULL;
+}
+
+/*
+ * Start nloops event loop threads.
+ * Returns 0 on success, -1 on failure.
+ */
+int epoll_server_start(int nloops) {
+    loops = calloc(nloops, sizeof(*loops));
+    if (!loops) return -1;
+
+    for (num_loops = 0; num_loops < nloops; num_loops++) {
+        struct event_loop *loop = &loops[num_loops];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+        LIST_INIT(&loop->conns);
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd == -1) break;
+        if (pipe2(loop->handoff, O_CLOEXEC) == -1) {
+            close(loop->epfd);
+            break;
+        }
+        // Only the read end is non-blocking, the accept thread may wait for a slow loop
+        fcntl(loop->handoff[0], F_SETFL, O_NONBLOCK);
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->handoff[0], &ev) == -1 ||
+            create_thread(&loop->thread, event_loop_run, loop) != 0) {
+            close(loop->handoff[0]);
+            close(loop->handoff[1]);
+            close(loop->epfd);
+            break;
+        }
+    }
+
+    if (num_loops < nloops) {
+        syslog(LOG_ERR, "Failed to start event loop %d: %s", num_loops, strerror(errno));
+        epoll_server_stop();
+        return -1;
+    }
+    syslog(LOG_INFO, "Started %d epoll event loops", num_loops);
+    return 0;
+}
+
+// Give an accepted client socket to the next event loop, returns -1 on failure
+int epoll_server_add_client(int client_fd) {
+    struct event_loop *loop = &loops[next_loop++ % num_loops];
+
+    // Writes of an int to a pipe are atomic, so a loop never sees half a descriptor
+    while (write(loop->handoff[1], &client_fd, sizeof(client_fd)) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+// Stop all event loops and close the connections they still own
+void epoll_server_stop(void) {
+    for (int i = 0; i < num_loops; i++) {
+        close(loops[i].handoff[1]);
+    }
+    for (int i = 0; i < num_loops; i++) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].handoff[0]);
+        close(loops[i].epfd);
+    }
+    free(loops);
+    loops = NULL;
+    num_loops = 0;
+}
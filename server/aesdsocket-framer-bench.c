@@ -0,0 +1,127 @@
+/*
+ * aesdsocket-framer-bench.c
+ *
+ * Small message throughput of the receive path, without sockets.
+ *
+ * A stream of short lines is cut into recv()-sized chunks and fed through
+ * either the line framer from aesdsocket-framer.c (-L framer) or the old
+ * handle_client() loop (-L realloc), which realloc()ed the message for every
+ * chunk, freed it after every line and dropped whatever followed the first
+ * newline in a chunk.
+ *
+ * Prints one CSV row: impl,line_bytes,chunk_bytes,lines_in,lines_out,seconds,
+ * lines_per_sec,mb_per_sec
+ *
+ * Usage: aesdsocket-framer-bench [-L framer|realloc] [-l line_bytes] [-c chunk_bytes] [-n lines]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+
+static volatile size_t sink; // Keeps the compiler from dropping the line handling
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t run_framer(const char *stream, size_t len, size_t chunk) {
+    struct line_framer f;
+    size_t lines = 0, off = 0;
+
+    framer_init(&f);
+    while (off < len) {
+        size_t space, n;
+        char *dst = framer_recv_space(&f, &space);
+        n = len - off < chunk ? len - off : chunk;
+        if (n > space) n = space;
+        memcpy(dst, stream + off, n); // Stands in for recv()
+        framer_commit(&f, n);
+        off += n;
+
+        const char *line;
+        size_t line_len;
+        while ((line = framer_next_line(&f, &line_len))) {
+            sink += line_len + (unsigned char)line[0];
+            lines++;
+        }
+    }
+    framer_destroy(&f);
+    return lines;
+}
+
+// The receive loop as it was in handle_client()
+static size_t run_realloc(const char *stream, size_t len, size_t chunk) {
+    char recv_buffer[65536];
+    char *full_msg = NULL;
+    size_t total_len = 0, lines = 0, off = 0;
+
+    if (chunk > sizeof(recv_buffer)) chunk = sizeof(recv_buffer);
+    while (off < len) {
+        size_t n = len - off < chunk ? len - off : chunk;
+        memcpy(recv_buffer, stream + off, n); // Stands in for recv()
+        off += n;
+
+        char *new_buf = realloc(full_msg, total_len + n);
+        if (!new_buf) break;
+        full_msg = new_buf;
+        memcpy(full_msg + total_len, recv_buffer, n);
+        total_len += n;
+
+        if (memchr(recv_buffer, '\n', n)) {
+            sink += total_len + (unsigned char)full_msg[0];
+            lines++;
+            free(full_msg);
+            full_msg = NULL;
+            total_len = 0;
+        }
+    }
+    free(full_msg);
+    return lines;
+}
+
+int main(int argc, char *argv[]) {
+    size_t line_bytes = 32, chunk = 1024, nlines = 5000000;
+    int use_realloc = 0, opt;
+
+    while ((opt = getopt(argc, argv, "L:l:c:n:")) != -1) {
+        switch (opt) {
+            case 'L': use_realloc = strcmp(optarg, "realloc") == 0; break;
+            case 'l': line_bytes = strtoul(optarg, NULL, 0); break;
+            case 'c': chunk = strtoul(optarg, NULL, 0); break;
+            case 'n': nlines = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "Usage: %s [-L framer|realloc] [-l line_bytes] [-c chunk_bytes] [-n lines]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (line_bytes < 2) line_bytes = 2;
+    if (chunk < 1) chunk = 1;
+
+    size_t len = line_bytes * nlines;
+    char *stream = malloc(len);
+    if (!stream) {
+        fprintf(stderr, "Failed to allocate %zu byte stream\n", len);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < len; i++) {
+        stream[i] = (i % line_bytes == line_bytes - 1) ? '\n' : 'a' + i % 26;
+    }
+
+    double start = now_s();
+    size_t lines = use_realloc ? run_realloc(stream, len, chunk) : run_framer(stream, len, chunk);
+    double elapsed = now_s() - start;
+
+    printf("impl,line_bytes,chunk_bytes,lines_in,lines_out,seconds,lines_per_sec,mb_per_sec\n");
+    printf("%s,%zu,%zu,%zu,%zu,%.3f,%.0f,%.1f\n", use_realloc ? "realloc" : "framer",
+           line_bytes, chunk, nlines, lines, elapsed, lines / elapsed, len / elapsed / 1e6);
+
+    free(stream);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+/*
+ * aesdsocket-framer.c
+ *
+ * Splits the byte stream received from a client into newline terminated
+ * lines. Each connection keeps one buffer that is reused for every message:
+ * data is received straight into its free tail, complete lines are handed
+ * out in place, and the unconsumed remainder is only moved to the front when
+ * the tail runs low. The buffer grows (geometrically) only for a line longer
+ * than it, and shrinks back once such a line has been consumed.
+ *
+ * Several lines in one recv() are all returned, nothing after the first
+ * newline is lost. Newlines are found with memchr(), which glibc implements
+ * with SIMD, and every byte is scanned only once even for lines that arrive
+ * over many receives.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesdsocket.h"
+
+#define FRAMER_INITIAL_SIZE 4096 // Also the size kept after a long line
+#define FRAMER_MIN_RECV 1024     // Compact or grow when less tail space is left
+
+void framer_init(struct line_framer *f) {
+    memset(f, 0, sizeof(*f));
+}
+
+void framer_destroy(struct line_framer *f) {
+    free(f->buf);
+    framer_init(f);
+}
+
+/*
+ * Returns where the next recv() should store data and how much fits in *space,
+ * or NULL if the buffer could not be allocated. Invalidates previously
+ * returned lines.
+ */
+char *framer_recv_space(struct line_framer *f, size_t *space) {
+    size_t pending = f->end - f->start;
+
+    if (pending == 0 && f->cap > FRAMER_INITIAL_SIZE * 16) {
+        // Give back the memory of an unusually long line
+        free(f->buf);
+        f->buf = NULL;
+        f->cap = 0;
+    }
+
+    if (f->cap - f->end < FRAMER_MIN_RECV) {
+        if (f->start > 0 && f->cap - pending >= FRAMER_MIN_RECV) {
+            // Enough room once the consumed bytes are dropped
+            memmove(f->buf, f->buf + f->start, pending);
+        } else {
+            size_t new_cap = f->cap ? f->cap * 2 : FRAMER_INITIAL_SIZE;
+            char *new_buf = malloc(new_cap);
+            if (!new_buf) return NULL;
+            if (pending) memcpy(new_buf, f->buf + f->start, pending);
+            free(f->buf);
+            f->buf = new_buf;
+            f->cap = new_cap;
+        }
+        f->start = 0;
+        f->end = pending;
+    }
+
+    *space = f->cap - f->end;
+    return f->buf + f->end;
+}
+
+// Account for n bytes received into the space from framer_recv_space()
+void framer_commit(struct line_framer *f, size_t n) {
+    f->end += n;
+}
+
+/*
+ * Returns the next complete line including its newline and its length in
+ * *len, or NULL if no complete line is buffered. The line stays valid until
+ * the next framer_recv_space() call.
+ */
+const char *framer_next_line(struct line_framer *f, size_t *len) {
+    char *line, *newline;
+
+    if (f->end - f->start == f->scanned) return NULL; // Nothing new to look at
+
+    line = f->buf + f->start;
+    newline = memchr(line + f->scanned, '\n', f->end - f->start - f->scanned);
+    if (!newline) {
+        f->scanned = f->end - f->start; // Never look at these bytes again
+        return NULL;
+    }
+
+    *len = newline - line + 1;
+    f->start += *len;
+    f->scanned = 0;
+
+    if (f->start == f->end) f->start = f->end = 0; // Reuse the buffer from the front
+    return line;
+}
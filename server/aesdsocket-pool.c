@@ -0,0 +1,305 @@
+/*
+ * aesdsocket-pool.c
+ *
+ * Fixed size worker pool for the thread per connection mode. The accept
+ * thread pushes accepted client sockets into a bounded lock-free MPMC queue
+ * (one sequence number per slot, after Dmitry Vyukov's bounded queue) and a
+ * fixed set of worker threads take them out and serve one client at a time.
+ * Semaphores count queued sockets and free slots, so idle workers sleep
+ * instead of spinning.
+ *
+ * When every slot is taken the accept thread either waits for a free slot,
+ * which leaves further connections in the kernel listen backlog, or sheds
+ * the new connection by closing it right away (-S).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+
+struct pool_slot {
+    _Atomic size_t seq; // Tells producers and consumers whose turn this slot is
+    int fd;
+    unsigned long long queued_ns; // When the socket was queued
+};
+
+struct pool_config pool_config = {
+    .workers = 32,
+    .queue_size = 64,
+    .shed = 0,
+};
+
+static struct pool_slot *slots;
+static size_t slot_mask;
+static _Atomic size_t enqueue_pos;
+static _Atomic size_t dequeue_pos;
+static sem_t queued; // Sockets in the queue
+static sem_t free_slots; // Slots a producer may still fill
+
+static pthread_t *workers;
+static int num_workers;
+static void (*serve_fn)(int client_fd);
+
+// Sockets being served, so pool_stop() can wake workers blocked on them
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *active_fds;
+static int stopping;
+
+// Counters, updated without locks and read with pool_get_stats()
+static _Atomic unsigned long long stat_accepted;
+static _Atomic unsigned long long stat_shed;
+static _Atomic unsigned long long stat_served;
+static _Atomic unsigned long long stat_wait_ns;
+static _Atomic unsigned long long stat_wait_max_ns;
+static _Atomic int stat_depth;
+static _Atomic int stat_depth_max;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void update_max_ull(_Atomic unsigned long long *max, unsigned long long value) {
+    unsigned long long cur = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > cur && !atomic_compare_exchange_weak_explicit(max, &cur, value,
+                                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void update_max_int(_Atomic int *max, int value) {
+    int cur = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > cur && !atomic_compare_exchange_weak_explicit(max, &cur, value,
+                                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Claim a slot and publish fd in it, returns -1 if the queue is full
+static int queue_push(int fd) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        struct pool_slot *slot = &slots[pos & slot_mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->fd = fd;
+                slot->queued_ns = now_ns();
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // The slot still holds an entry from the previous lap
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Take the oldest published fd, returns -1 if the queue is empty
+static int queue_pop(int *fd, unsigned long long *queued_ns) {
+    size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        struct pool_slot *slot = &slots[pos & slot_mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *fd = slot->fd;
+                *queued_ns = slot->queued_ns;
+                // Hand the slot to the producer one lap ahead
+                atomic_store_explicit(&slot->seq, pos + slot_mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void *worker_run(void *arg) {
+    int id = (int)(long)arg;
+
+    for (;;) {
+        int fd;
+        unsigned long long queued_ns;
+
+        while (sem_wait(&queued) == -1 && errno == EINTR) {
+        }
+        if (queue_pop(&fd, &queued_ns) == -1) break; // Woken by pool_stop() with nothing left
+        sem_post(&free_slots);
+
+        atomic_fetch_sub_explicit(&stat_depth, 1, memory_order_relaxed);
+        unsigned long long waited = now_ns() - queued_ns;
+        atomic_fetch_add_explicit(&stat_wait_ns, waited, memory_order_relaxed);
+        update_max_ull(&stat_wait_max_ns, waited);
+
+        pthread_mutex_lock(&active_lock);
+        if (stopping) {
+            // Shutting down, do not start serving anyone new
+            pthread_mutex_unlock(&active_lock);
+            close(fd);
+            continue;
+        }
+        active_fds[id] = fd;
+        pthread_mutex_unlock(&active_lock);
+
+        serve_fn(fd);
+        atomic_fetch_add_explicit(&stat_served, 1, memory_order_relaxed);
+
+        // Forget the socket before closing it, its number may be reused right away
+        pthread_mutex_lock(&active_lock);
+        active_fds[id] = -1;
+        pthread_mutex_unlock(&active_lock);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Start pool_config.workers threads that call serve(client_fd) for every
+ * submitted socket and close it afterwards.
+ * Returns 0 on success, -1 on failure.
+ */
+int pool_start(void (*serve)(int client_fd)) {
+    size_t size = 1;
+    int ret;
+
+    // Round the queue up to a power of two so a slot index is a mask away
+    while (size < (size_t)pool_config.queue_size) size <<= 1;
+    slot_mask = size - 1;
+
+    slots = calloc(size, sizeof(*slots));
+    workers = calloc(pool_config.workers, sizeof(*workers));
+    active_fds = malloc(pool_config.workers * sizeof(*active_fds));
+    if (!slots || !workers || !active_fds) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        free(slots);
+        free(workers);
+        free(active_fds);
+        slots = NULL;
+        workers = NULL;
+        active_fds = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&slots[i].seq, i);
+    }
+    for (int i = 0; i < pool_config.workers; i++) {
+        active_fds[i] = -1;
+    }
+    sem_init(&queued, 0, 0);
+    sem_init(&free_slots, 0, size);
+    serve_fn = serve;
+
+    for (num_workers = 0; num_workers < pool_config.workers; num_workers++) {
+        ret = create_thread(&workers[num_workers], worker_run, (void *)(long)num_workers);
+        if (ret != 0) {
+            syslog(LOG_ERR, "Failed to create worker thread %d: %s", num_workers, strerror(ret));
+            pool_stop();
+            return -1;
+        }
+    }
+    syslog(LOG_INFO, "Started %d workers, queue of %zu connections%s",
+           num_workers, size, pool_config.shed ? ", shedding when full" : "");
+    return 0;
+}
+
+/*
+ * Queue an accepted client socket for the workers. If the queue is full the
+ * call waits for a free slot, or with pool_config.shed closes the socket.
+ * Returns 0 if the socket was queued, -1 if it was closed instead.
+ */
+int pool_submit(int client_fd) {
+    if (pool_config.shed) {
+        if (sem_trywait(&free_slots) == -1) {
+            atomic_fetch_add_explicit(&stat_shed, 1, memory_order_relaxed);
+            close(client_fd);
+            return -1;
+        }
+    } else {
+        while (sem_wait(&free_slots) == -1) {
+            if (errno != EINTR || shutdown_flag) {
+                close(client_fd);
+                return -1;
+            }
+        }
+    }
+
+    // A free slot was reserved above, so the push can not fail
+    queue_push(client_fd);
+    int depth = atomic_fetch_add_explicit(&stat_depth, 1, memory_order_relaxed) + 1;
+    update_max_int(&stat_depth_max, depth);
+    atomic_fetch_add_explicit(&stat_accepted, 1, memory_order_relaxed);
+    sem_post(&queued);
+    return 0;
+}
+
+void pool_get_stats(struct pool_stats *stats) {
+    stats->accepted = atomic_load_explicit(&stat_accepted, memory_order_relaxed);
+    stats->shed = atomic_load_explicit(&stat_shed, memory_order_relaxed);
+    stats->served = atomic_load_explicit(&stat_served, memory_order_relaxed);
+    stats->wait_ns = atomic_load_explicit(&stat_wait_ns, memory_order_relaxed);
+    stats->wait_max_ns = atomic_load_explicit(&stat_wait_max_ns, memory_order_relaxed);
+    stats->depth = atomic_load_explicit(&stat_depth, memory_order_relaxed);
+    stats->depth_max = atomic_load_explicit(&stat_depth_max, memory_order_relaxed);
+}
+
+void pool_log_stats(void) {
+    struct pool_stats s;
+    unsigned long long dequeued;
+
+    pool_get_stats(&s);
+    dequeued = s.accepted - (s.depth > 0 ? s.depth : 0);
+    syslog(LOG_INFO, "Pool: %llu accepted, %llu shed, %llu served, queue depth %d (max %d), "
+           "queue wait avg %llu us max %llu us",
+           s.accepted, s.shed, s.served, s.depth, s.depth_max,
+           dequeued ? s.wait_ns / dequeued / 1000 : 0, s.wait_max_ns / 1000);
+}
+
+// Wake every worker, drop queued connections and wait for the workers to exit
+void pool_stop(void) {
+    pthread_mutex_lock(&active_lock);
+    stopping = 1;
+    for (int i = 0; i < num_workers; i++) {
+        // Makes a worker blocked in recv()/send() on this client return
+        if (active_fds[i] != -1) shutdown(active_fds[i], SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    // One extra wake up per worker, each exits when it finds the queue empty
+    for (int i = 0; i < num_workers; i++) {
+        sem_post(&queued);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (slots) {
+        sem_destroy(&queued);
+        sem_destroy(&free_slots);
+    }
+    free(slots);
+    free(workers);
+    free(active_fds);
+    slots = NULL;
+    workers = NULL;
+    active_fds = NULL;
+    num_workers = 0;
+}
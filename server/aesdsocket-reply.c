@@ -0,0 +1,190 @@
+/*
+ * aesdsocket-reply.c
+ *
+ * Streams replies from the data file (or /dev/aesdchar) to a client socket.
+ *
+ * Regular files are sent with sendfile() and the device with splice() through
+ * a staging pipe, so reply data never passes through user space. Devices or
+ * file systems that do not support either fall back to a read()/send() copy
+ * loop. The same code serves blocking sockets (thread per connection mode)
+ * and non-blocking ones (epoll mode), partial progress is kept in the stream.
+ */
+
+#define _GNU_SOURCE // splice, F_SETPIPE_SZ
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+
+#define SENDFILE_CHUNK (1 << 20) // Upper bound per sendfile() call
+#define PIPE_SIZE (1 << 20)      // Requested staging pipe capacity for splice()
+#define COPY_CHUNK 4096          // Staging buffer for the copy fallback
+
+int zero_copy_disabled = 0; // -C: always use the read()/send() copy loop
+
+// Set once the kernel rejected zero copy for our source, no point retrying
+static int sendfile_unsupported;
+static int splice_unsupported;
+
+void reply_stream_init(struct reply_stream *r) {
+    memset(r, 0, sizeof(*r));
+    r->file_fd = -1;
+    r->pipe_fd[0] = r->pipe_fd[1] = -1;
+}
+
+void reply_stream_destroy(struct reply_stream *r) {
+    if (r->pipe_fd[0] != -1) close(r->pipe_fd[0]);
+    if (r->pipe_fd[1] != -1) close(r->pipe_fd[1]);
+    free(r->buf);
+    reply_stream_init(r);
+}
+
+// Begin sending len bytes (-1: until EOF) from the current position of file_fd
+void reply_stream_start(struct reply_stream *r, int file_fd, off_t len) {
+    r->file_fd = file_fd;
+    r->left = len;
+    r->pending = 0;
+    r->buf_off = 0;
+
+    if (zero_copy_disabled) {
+        r->method = REPLY_COPY;
+    } else {
+        #if USE_AESD_CHAR_DEVICE
+            r->method = splice_unsupported ? REPLY_COPY : REPLY_SPLICE;
+        #else
+            r->method = sendfile_unsupported ? REPLY_COPY : REPLY_SENDFILE;
+        #endif
+    }
+}
+
+// Pipe used to stage spliced data, created on the first device reply
+static int reply_pipe_open(struct reply_stream *r) {
+    if (r->pipe_fd[0] != -1) return 0;
+    if (pipe2(r->pipe_fd, O_CLOEXEC) == -1) {
+        syslog(LOG_ERR, "Failed to create splice pipe: %s", strerror(errno));
+        return -1;
+    }
+    // A bigger pipe means fewer splice calls, keep the default if not allowed
+    fcntl(r->pipe_fd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    int size = fcntl(r->pipe_fd[1], F_GETPIPE_SZ);
+    r->pipe_size = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+// Bytes to request from the source next, bounded by what is left of the reply
+static size_t next_chunk(const struct reply_stream *r, size_t max) {
+    if (r->left >= 0 && r->left < (off_t)max) return (size_t)r->left;
+    return max;
+}
+
+/*
+ * Move the next chunk of the reply out of the source file. For sendfile this
+ * already delivers it to the socket, otherwise it is staged in the pipe or
+ * buffer as r->pending. Returns 1 on progress, 0 at the end of the reply,
+ * -2 if the socket would block and -1 on error.
+ */
+static int reply_fill(struct reply_stream *r, int client_fd) {
+    ssize_t n;
+
+    if (r->left == 0) return 0;
+
+    switch (r->method) {
+        case REPLY_SENDFILE:
+            n = sendfile(client_fd, r->file_fd, NULL, next_chunk(r, SENDFILE_CHUNK));
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                syslog(LOG_INFO, "sendfile not supported, copying replies");
+                sendfile_unsupported = 1;
+                r->method = REPLY_COPY;
+                return 1;
+            }
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+                if (errno == EINTR) return 1;
+                return -1;
+            }
+            if (n > 0) stats_bytes_out(n);
+            break;
+
+        case REPLY_SPLICE:
+            if (reply_pipe_open(r) == -1) {
+                r->method = REPLY_COPY;
+                return 1;
+            }
+            // The pipe is empty here, so this never blocks on the pipe side
+            n = splice(r->file_fd, NULL, r->pipe_fd[1], NULL, next_chunk(r, r->pipe_size), SPLICE_F_MOVE);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                syslog(LOG_INFO, "splice not supported by %s, copying replies", FILE_PATH);
+                splice_unsupported = 1;
+                r->method = REPLY_COPY;
+                return 1;
+            }
+            if (n > 0) r->pending = n;
+            break;
+
+        default: // REPLY_COPY
+            if (!r->buf && !(r->buf = malloc(COPY_CHUNK))) {
+                syslog(LOG_ERR, "Memory allocation failed");
+                return -1;
+            }
+            n = read(r->file_fd, r->buf, next_chunk(r, COPY_CHUNK));
+            if (n > 0) {
+                r->pending = n;
+                r->buf_off = 0;
+            }
+            break;
+    }
+
+    if (n == -1) {
+        if (errno == EINTR) return 1;
+        syslog(LOG_ERR, "Reading reply failed: %s", strerror(errno));
+        return 0; // Send what we have, like a short file
+    }
+    if (n == 0) return 0; // EOF
+    if (r->left > 0) r->left -= n;
+    return 1;
+}
+
+// Send staged bytes, returns 1 on progress, -2 if the socket would block and -1 on error
+static int reply_drain(struct reply_stream *r, int client_fd) {
+    ssize_t n;
+
+    if (r->method == REPLY_SPLICE) {
+        n = splice(r->pipe_fd[0], NULL, client_fd, NULL, r->pending, SPLICE_F_MOVE);
+    } else {
+        n = send(client_fd, r->buf + r->buf_off, r->pending, MSG_NOSIGNAL);
+        if (n > 0) r->buf_off += n;
+    }
+
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+        if (errno == EINTR) return 1;
+        if (errno != EPIPE && errno != ECONNRESET) {
+            syslog(LOG_ERR, "send failed: %s", strerror(errno));
+        }
+        return -1;
+    }
+    r->pending -= n;
+    stats_bytes_out(n);
+    return 1;
+}
+
+/*
+ * Send as much of the reply as the socket accepts. With a blocking socket
+ * this only returns once the reply is complete or failed.
+ * Returns 1 when the reply is complete, 0 if the socket would block and -1
+ * if the connection failed.
+ */
+int reply_stream_flush(struct reply_stream *r, int client_fd) {
+    for (;;) {
+        int ret = r->pending ? reply_drain(r, client_fd) : reply_fill(r, client_fd);
+        if (ret == 0) return 1;
+        if (ret == -2) return 0;
+        if (ret == -1) return -1;
+    }
+}
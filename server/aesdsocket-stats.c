@@ -0,0 +1,237 @@
+/*
+ * aesdsocket-stats.c
+ *
+ * Runtime statistics, reported to clients that send AESDSTATS.
+ *
+ * Every thread that updates a counter gets its own shard, so the hot paths
+ * never share a cache line or take a lock: a shard has a single writer that
+ * updates it with plain relaxed loads and stores. A stats request sums all
+ * shards while they keep changing, so a report is a close approximation
+ * rather than a snapshot, which is fine for monitoring.
+ *
+ * Per message latency runs from the moment a complete line is taken off the
+ * connection until its reply has been sent. It is kept in a log-linear
+ * histogram (8 buckets per power of two, so within 12.5%) from which the
+ * percentiles are read.
+ */
+
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "aesdsocket.h"
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef _Atomic unsigned long long counter_t;
+
+struct stats_shard {
+    counter_t conns_opened;
+    counter_t conns_closed;
+    counter_t messages;
+    counter_t bytes_in;
+    counter_t bytes_out;
+    counter_t append_waits;
+    counter_t append_wait_ns;
+    counter_t append_wait_max_ns;
+    counter_t latency_max_ns;
+    counter_t latency[HIST_BUCKETS];
+    struct stats_shard *next;
+};
+
+const char *stats_backend = "threads"; // Server mode named in the report
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER; // Only taken to add a shard
+static struct stats_shard *_Atomic shards;
+static __thread struct stats_shard *my_shard;
+static time_t start_time;
+
+// Shard of the calling thread, created on first use
+static struct stats_shard *shard(void) {
+    if (my_shard) return my_shard;
+
+    struct stats_shard *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    pthread_mutex_lock(&shards_lock);
+    s->next = atomic_load_explicit(&shards, memory_order_relaxed);
+    atomic_store_explicit(&shards, s, memory_order_release);
+    pthread_mutex_unlock(&shards_lock);
+    my_shard = s;
+    return s;
+}
+
+// Only the owning thread writes a shard, so no read-modify-write is needed
+static void add(counter_t *c, unsigned long long v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void set_max(counter_t *c, unsigned long long v) {
+    if (v > atomic_load_explicit(c, memory_order_relaxed)) atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+static int hist_bucket(unsigned long long v) {
+    if (v < HIST_SUB) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Largest value that falls into bucket b
+static unsigned long long hist_upper(int b) {
+    if (b < HIST_SUB) return b;
+    int msb = b / HIST_SUB + HIST_SUB_BITS - 1;
+    unsigned long long width = 1ULL << (msb - HIST_SUB_BITS);
+    return (unsigned long long)(HIST_SUB + b % HIST_SUB) * width + width - 1;
+}
+
+unsigned long long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_init(void) {
+    start_time = time(NULL);
+}
+
+void stats_conn_opened(void) {
+    struct stats_shard *s = shard();
+    if (s) add(&s->conns_opened, 1);
+}
+
+void stats_conn_closed(void) {
+    struct stats_shard *s = shard();
+    if (s) add(&s->conns_closed, 1);
+}
+
+// A complete line of len bytes was received
+void stats_line_in(size_t len) {
+    struct stats_shard *s = shard();
+    if (!s) return;
+    add(&s->messages, 1);
+    add(&s->bytes_in, len);
+}
+
+void stats_bytes_out(size_t len) {
+    struct stats_shard *s = shard();
+    if (s) add(&s->bytes_out, len);
+}
+
+// A line taken at start_ns (stats_now_ns()) has been fully answered
+void stats_line_done(unsigned long long start_ns) {
+    struct stats_shard *s = shard();
+    if (!s) return;
+    unsigned long long ns = stats_now_ns() - start_ns;
+    add(&s->latency[hist_bucket(ns)], 1);
+    set_max(&s->latency_max_ns, ns);
+}
+
+// Time an append spent waiting for the data file lock and group commit, in
+// io_uring mode from submitting its write until it completed
+void stats_append_wait(unsigned long long ns) {
+    struct stats_shard *s = shard();
+    if (!s) return;
+    add(&s->append_waits, 1);
+    add(&s->append_wait_ns, ns);
+    set_max(&s->append_wait_max_ns, ns);
+}
+
+// Upper bound of the bucket holding percentile p, no more than the largest value seen
+static unsigned long long percentile_us(const unsigned long long *hist, unsigned long long count, double p,
+                                        unsigned long long max_ns) {
+    unsigned long long rank = (unsigned long long)(p * count), seen = 0;
+
+    if (count == 0) return 0;
+    if (rank >= count) rank = count - 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) return (hist_upper(b) < max_ns ? hist_upper(b) : max_ns) / 1000;
+    }
+    return 0;
+}
+
+// Sum all shards and write the report as "name value" lines, ended by an empty line
+static void stats_write(FILE *out) {
+    unsigned long long hist[HIST_BUCKETS];
+    unsigned long long opened = 0, closed = 0, messages = 0, bytes_in = 0, bytes_out = 0;
+    unsigned long long waits = 0, wait_ns = 0, wait_max = 0, lat_max = 0, lat_count = 0;
+
+    memset(hist, 0, sizeof(hist));
+    for (struct stats_shard *s = atomic_load_explicit(&shards, memory_order_acquire); s; s = s->next) {
+        opened += atomic_load_explicit(&s->conns_opened, memory_order_relaxed);
+        closed += atomic_load_explicit(&s->conns_closed, memory_order_relaxed);
+        messages += atomic_load_explicit(&s->messages, memory_order_relaxed);
+        bytes_in += atomic_load_explicit(&s->bytes_in, memory_order_relaxed);
+        bytes_out += atomic_load_explicit(&s->bytes_out, memory_order_relaxed);
+        waits += atomic_load_explicit(&s->append_waits, memory_order_relaxed);
+        wait_ns += atomic_load_explicit(&s->append_wait_ns, memory_order_relaxed);
+        unsigned long long m = atomic_load_explicit(&s->append_wait_max_ns, memory_order_relaxed);
+        if (m > wait_max) wait_max = m;
+        m = atomic_load_explicit(&s->latency_max_ns, memory_order_relaxed);
+        if (m > lat_max) lat_max = m;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            unsigned long long n = atomic_load_explicit(&s->latency[b], memory_order_relaxed);
+            hist[b] += n;
+            lat_count += n;
+        }
+    }
+
+    fprintf(out, "backend %s\n", stats_backend);
+    fprintf(out, "uptime_s %lld\n", (long long)(time(NULL) - start_time));
+    // Closes can be summed before the matching opens, never report less than zero
+    fprintf(out, "connections_active %llu\n", opened > closed ? opened - closed : 0);
+    fprintf(out, "connections_total %llu\n", opened);
+    fprintf(out, "messages %llu\n", messages);
+    fprintf(out, "bytes_in %llu\n", bytes_in);
+    fprintf(out, "bytes_out %llu\n", bytes_out);
+    fprintf(out, "append_waits %llu\n", waits);
+    fprintf(out, "append_wait_avg_us %llu\n", waits ? wait_ns / waits / 1000 : 0);
+    fprintf(out, "append_wait_max_us %llu\n", wait_max / 1000);
+    fprintf(out, "latency_count %llu\n", lat_count);
+    fprintf(out, "latency_p50_us %llu\n", percentile_us(hist, lat_count, 0.50, lat_max));
+    fprintf(out, "latency_p99_us %llu\n", percentile_us(hist, lat_count, 0.99, lat_max));
+    fprintf(out, "latency_p999_us %llu\n", percentile_us(hist, lat_count, 0.999, lat_max));
+    fprintf(out, "latency_max_us %llu\n", lat_max / 1000);
+
+    if (strcmp(stats_backend, "threads") == 0) {
+        struct pool_stats ps;
+        pool_get_stats(&ps);
+        unsigned long long dequeued = ps.accepted - (ps.depth > 0 ? ps.depth : 0);
+        fprintf(out, "pool_queue_depth %d\n", ps.depth);
+        fprintf(out, "pool_queue_depth_max %d\n", ps.depth_max);
+        fprintf(out, "pool_shed %llu\n", ps.shed);
+        fprintf(out, "pool_queue_wait_avg_us %llu\n", dequeued ? ps.wait_ns / dequeued / 1000 : 0);
+        fprintf(out, "pool_queue_wait_max_us %llu\n", ps.wait_max_ns / 1000);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Write a report into an anonymous memory file and return it positioned at
+ * the start, so it can be streamed like any other reply. Returns -1 on error.
+ */
+int stats_report_fd(void) {
+    int fd = memfd_create("aesdstats", MFD_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create stats report");
+        return -1;
+    }
+
+    FILE *out = fdopen(dup(fd), "w");
+    if (!out) {
+        close(fd);
+        return -1;
+    }
+    stats_write(out);
+    fclose(out);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
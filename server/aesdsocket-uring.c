@@ -0,0 +1,923 @@
+/*
+ * aesdsocket-uring.c
+ *
+ * io_uring server mode for aesdsocket (-u), talking to the kernel through
+ * the raw io_uring syscalls so no extra library is needed.
+ *
+ * One ring serves every client from the main thread:
+ *  - a multishot accept installs each client straight into the ring's
+ *    registered file table, client sockets never get a normal descriptor
+ *  - a multishot recv per client takes buffers from a provided buffer ring,
+ *    the bytes are copied into the connection's line framer and the buffer
+ *    is handed straight back
+ *  - the data file is a registered file as well; an appended line is written
+ *    at an offset reserved for it, and when the reply is exactly that line
+ *    (tail mode, nothing else appended in between) the write is linked to
+ *    the send of the same buffer
+ *  - other replies are read from the file and sent with linked read -> send
+ *    pairs, one pair per chunk
+ * With many clients busy, one io_uring_enter() submits and reaps the work of
+ * all of them, so the syscall count per message goes towards zero.
+ *
+ * Writes can complete out of order. Replies that cover other lines wait
+ * until every write below their end has completed, which keeps the rule of
+ * the other modes that a reply only contains complete data.
+ *
+ * AESDCHAR_IOCSEEKTO and AESDSOCKET_REPLY lines are rare and go through
+ * process_line() synchronously, only the reply is streamed by the ring.
+ * For /dev/aesdchar every client gets its own reader descriptor, and an
+ * appended line is linked write -> read -> send, reading until EOF.
+ *
+ * Built unless USE_IO_URING=0 is passed to make, for toolchains whose kernel
+ * headers predate io_uring. Needs Linux 6.0 or later at run time.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+
+#if USE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES 256      // Submission queue size
+#define CQ_ENTRIES 4096       // Completion queue size, multishot ops post many
+#define MAX_CLIENTS 4096      // Registered file slots for client sockets
+#define RECV_BUFS 256         // Provided receive buffers, a power of two
+#define RECV_BUF_SIZE 4096
+#define RECV_GROUP 0          // Buffer group id of the receive buffers
+#define REPLY_CHUNK 65536     // Bytes per linked read -> send pair
+#define TIMESTAMP_SECS 10
+
+// Registered file table layout, clients are allocated above these
+#define SLOT_LOG_WRITE 0 // Data file, written at reserved offsets
+#define SLOT_LOG_READ 1  // Data file, read for replies
+#define SLOT_FIRST_CLIENT 2
+
+// Operation kinds, kept in the low bits of the user_data pointer
+enum uring_op {
+    OP_IGNORE,  // Cancels and closes, nothing to do on completion
+    OP_ACCEPT,
+    OP_SIGNAL,
+    OP_TIMER,
+    OP_RECV,
+    OP_WRITE,
+    OP_READ,
+    OP_SEND
+};
+#define OP_MASK 7
+
+enum uconn_state {
+    UCONN_READING,  // Waiting for a complete line
+    UCONN_WAITING,  // Line written, waiting for earlier writes before replying
+    UCONN_REPLYING  // Reply in flight
+};
+
+struct uconn;
+
+/*
+ * An append to the data file, kept in offset order until it and every write
+ * before it completed. Its owner counts it in inflight until then, and does
+ * not reuse it for the next line before.
+ */
+struct log_write {
+    off_t off;
+    size_t len;
+    int done;
+    int queued; // Still in the writes list
+    unsigned long long submit_ns; // Reported as the append wait once it completes
+    struct uconn *owner; // NULL for timestamps
+    TAILQ_ENTRY(log_write) entries;
+};
+
+struct uconn {
+    int slot;           // Registered file index of the client socket
+    int inflight;       // Submitted operations that still reference this connection
+    int closing;
+    int peer_closed;
+    int recv_armed;
+    enum uconn_state state;
+    struct client_state cs;
+    struct line_framer framer;
+
+    char *line;         // Copy of the line being handled, written and maybe sent from
+    size_t line_cap;
+    size_t line_len;
+    struct log_write write;
+    off_t reply_end;    // Data length the reply covers
+    unsigned long long line_start_ns; // When the line being answered was taken
+
+    // Reply source, streamed in linked read -> send chunks
+    int src_fd;
+    int src_fixed;      // src_fd is a registered file index
+    int src_close;      // src_fd came from process_line(), finish_reply() closes it
+    off_t src_off;      // Next read position, -1 for the descriptor's own position
+    off_t src_left;     // Bytes still to send, -1 means until EOF
+    int line_reply;     // Reply is the line buffer itself, no read needed
+    char *buf;
+    ssize_t read_res;   // Result of the read half of the current chunk
+
+    int dev_fd;         // Per client reader for /dev/aesdchar, -1 until needed
+
+    LIST_ENTRY(uconn) entries;
+    LIST_ENTRY(uconn) waiting;
+};
+
+static int ring_fd = -1;
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+static unsigned int sq_pending; // Prepared but not yet submitted
+
+static struct io_uring_buf_ring *recv_ring;
+static char *recv_bufs;
+static unsigned short recv_tail;
+
+static int listen_fd;
+static int signal_fd = -1; // Shutdown signals arrive as reads completing on the ring
+static struct signalfd_siginfo signal_info;
+static int ring_failed;
+static int accept_paused; // Every client slot is taken, accept again once one is free
+static LIST_HEAD(uconn_list, uconn) conns;
+static LIST_HEAD(wait_list, uconn) waiters;
+
+// Data file bookkeeping, only the ring thread touches it
+static TAILQ_HEAD(write_list, log_write) writes;
+static off_t log_end;  // End of the data including writes still in flight
+static off_t done_end; // Every byte below this has been written
+
+#if !USE_AESD_CHAR_DEVICE
+static struct __kernel_timespec timer_ts = { .tv_sec = TIMESTAMP_SECS };
+static struct log_write ts_write;
+static char ts_buf[100];
+static int ts_busy;
+#endif
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                           void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static uint64_t ud(void *ptr, enum uring_op op) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+// Hand prepared entries to the kernel without waiting for completions
+static void ring_submit(void) {
+    while (sq_pending > 0) {
+        int ret = sys_uring_enter(sq_pending, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            return;
+        }
+        sq_pending -= ret;
+    }
+}
+
+// Make room for n entries, a linked chain must not be split across submissions
+static void ring_reserve(unsigned int n) {
+    if (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + n > RING_ENTRIES) {
+        ring_submit();
+    }
+}
+
+// Next free submission entry, zeroed, submitting first if the queue is full
+static struct io_uring_sqe *get_sqe(void) {
+    ring_reserve(1);
+
+    unsigned int tail = *sq_tail;
+    struct io_uring_sqe *sqe = &sqes[tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    sq_pending++;
+    return sqe;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned int len, uint64_t off) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+static void recv_buf_give(unsigned short bid) {
+    struct io_uring_buf *b = &recv_ring->bufs[recv_tail & (RECV_BUFS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(recv_bufs + (size_t)bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    recv_tail++;
+    __atomic_store_n(&recv_ring->tail, recv_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(void) {
+    struct io_uring_sqe *sqe = get_sqe();
+    prep_rw(sqe, IORING_OP_ACCEPT, listen_fd, NULL, 0, 0);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = ud(NULL, OP_ACCEPT);
+}
+
+static void arm_signal(void) {
+    struct io_uring_sqe *sqe = get_sqe();
+    prep_rw(sqe, IORING_OP_READ, signal_fd, &signal_info, sizeof(signal_info), 0);
+    sqe->user_data = ud(NULL, OP_SIGNAL);
+}
+
+static void arm_recv(struct uconn *c) {
+    struct io_uring_sqe *sqe = get_sqe();
+    prep_rw(sqe, IORING_OP_RECV, c->slot, NULL, 0, 0);
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = ud(c, OP_RECV);
+    c->recv_armed = 1;
+    c->inflight++;
+}
+
+#if !USE_AESD_CHAR_DEVICE
+static void arm_timer(void) {
+    struct io_uring_sqe *sqe = get_sqe();
+    prep_rw(sqe, IORING_OP_TIMEOUT, -1, &timer_ts, 1, 0);
+    sqe->user_data = ud(NULL, OP_TIMER);
+}
+#endif
+
+// Reserve the next range of the data file for w and submit its write
+static struct io_uring_sqe *submit_log_write(struct log_write *w, const char *data, size_t len, int link) {
+    struct io_uring_sqe *sqe = get_sqe();
+
+    w->len = len;
+    w->done = 0;
+    w->submit_ns = stats_now_ns();
+    #if USE_AESD_CHAR_DEVICE
+        w->off = -1; // The driver appends, write at the descriptor's own position
+    #else
+        w->off = log_end;
+        log_end += len;
+        w->queued = 1;
+        TAILQ_INSERT_TAIL(&writes, w, entries);
+    #endif
+    prep_rw(sqe, IORING_OP_WRITE, SLOT_LOG_WRITE, data, len, w->off);
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    sqe->user_data = ud(w, OP_WRITE);
+    return sqe;
+}
+
+// Free a connection's memory and the descriptors it opened itself
+static void conn_release(struct uconn *c) {
+    if (c->src_close && c->src_fd != -1) close(c->src_fd);
+    if (c->dev_fd != -1) close(c->dev_fd);
+    framer_destroy(&c->framer);
+    free(c->line);
+    free(c->buf);
+    free(c);
+}
+
+static void conn_free(struct uconn *c) {
+    struct io_uring_sqe *sqe = get_sqe();
+
+    // Release the registered slot, nothing to report when it succeeds
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = c->slot + 1;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = ud(NULL, OP_IGNORE);
+
+    LIST_REMOVE(c, entries);
+    conn_release(c);
+    stats_conn_closed();
+
+    if (accept_paused) {
+        accept_paused = 0;
+        arm_accept();
+    }
+}
+
+// Start closing a connection, it is freed once no operation refers to it
+static void conn_close(struct uconn *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        if (c->state == UCONN_WAITING) LIST_REMOVE(c, waiting);
+        if (c->recv_armed) {
+            struct io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ud(c, OP_RECV);
+            sqe->user_data = ud(NULL, OP_IGNORE);
+        }
+    }
+    if (c->inflight == 0) conn_free(c);
+}
+
+static void conn_open(int slot) {
+    struct uconn *c = calloc(1, sizeof(*c));
+
+    if (!c) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = slot + 1;
+        sqe->user_data = ud(NULL, OP_IGNORE);
+        return;
+    }
+    c->slot = slot;
+    c->state = UCONN_READING;
+    c->src_fd = -1;
+    c->dev_fd = -1;
+    client_state_init(&c->cs);
+    framer_init(&c->framer);
+    LIST_INSERT_HEAD(&conns, c, entries);
+    stats_conn_opened();
+    arm_recv(c);
+}
+
+/*
+ * Queue the next chunk of the reply as a linked read -> send pair. If the
+ * read comes up short the send is cancelled and reissued for what was read.
+ */
+static void reply_chunk(struct uconn *c) {
+    struct io_uring_sqe *sqe;
+    size_t len = REPLY_CHUNK;
+
+    if (c->src_left >= 0 && c->src_left < (off_t)len) len = (size_t)c->src_left;
+
+    ring_reserve(2);
+    sqe = get_sqe();
+    prep_rw(sqe, IORING_OP_READ, c->src_fd, c->buf, len, (uint64_t)c->src_off);
+    sqe->flags = IOSQE_IO_LINK | (c->src_fixed ? IOSQE_FIXED_FILE : 0);
+    sqe->user_data = ud(c, OP_READ);
+
+    sqe = get_sqe();
+    prep_rw(sqe, IORING_OP_SEND, c->slot, c->buf, len, 0);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = ud(c, OP_SEND);
+
+    c->read_res = 0;
+    c->inflight += 2;
+}
+
+// Reply staging buffer, allocated on the first reply that reads the file
+static int reply_buf_alloc(struct uconn *c) {
+    if (!c->buf && !(c->buf = malloc(REPLY_CHUNK))) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Begin streaming a reply from src. Returns 0 once it is under way, 1 if
+ * there is nothing to send and -1 if the connection should close.
+ */
+static int reply_begin(struct uconn *c, int src_fd, int fixed, off_t off, off_t left) {
+    if (reply_buf_alloc(c) == -1) return -1;
+    c->src_fd = src_fd;
+    c->src_fixed = fixed;
+    c->src_off = off;
+    c->src_left = left;
+    c->line_reply = 0;
+    c->state = UCONN_REPLYING;
+    if (left == 0) return 1; // Nothing to send
+    reply_chunk(c);
+    return 0;
+}
+
+static int conn_advance(struct uconn *c);
+
+// The reply is complete, move on to the next buffered line
+static void reply_done(struct uconn *c) {
+    if (c->src_close) {
+        finish_reply(&c->cs, c->src_fd);
+        c->src_close = 0;
+    } else if (c->src_fd == c->dev_fd && c->dev_fd != -1) {
+        c->cs.cursor = c->src_off; // Next tail starts where this reply hit EOF
+    }
+    c->src_fd = -1;
+    c->state = UCONN_READING;
+    stats_line_done(c->line_start_ns);
+    if (conn_advance(c) == -1) conn_close(c);
+}
+
+#if !USE_AESD_CHAR_DEVICE
+// Start every waiting reply whose data has been written completely
+static void wake_waiters(void) {
+    struct uconn *c, *next;
+
+    for (c = LIST_FIRST(&waiters); c; c = next) {
+        next = LIST_NEXT(c, waiting);
+        if (c->reply_end > done_end) continue;
+        LIST_REMOVE(c, waiting);
+
+        off_t start = c->cs.tail_mode && c->cs.cursor < c->reply_end ? c->cs.cursor : 0;
+        c->cs.cursor = c->reply_end;
+        int ret = reply_begin(c, SLOT_LOG_READ, 1, start, c->reply_end - start);
+        if (ret == -1) conn_close(c);
+        else if (ret == 1) reply_done(c);
+    }
+}
+#endif
+
+/*
+ * Append the line in c->line and arrange the reply for it.
+ * Returns -1 if the connection should be closed.
+ */
+static int handle_data_line(struct uconn *c) {
+    c->write.owner = c;
+    ring_reserve(3); // Longest chain is write -> read -> send
+
+    #if USE_AESD_CHAR_DEVICE
+        // write -> read -> send, the read only starts once our line is in
+        if (c->dev_fd == -1 && (c->dev_fd = open(FILE_PATH, O_RDONLY | O_CLOEXEC)) == -1) {
+            syslog(LOG_ERR, "Failed to open %s for reading: %s", FILE_PATH, strerror(errno));
+            return -1;
+        }
+        // Nothing may fail between the linked write and the read after it
+        if (reply_buf_alloc(c) == -1) return -1;
+        submit_log_write(&c->write, c->line, c->line_len, 1);
+        c->inflight++;
+        reply_begin(c, c->dev_fd, 0, c->cs.tail_mode ? c->cs.cursor : 0, -1);
+        return 0;
+    #else
+        off_t off = log_end;
+        c->reply_end = off + c->line_len;
+
+        if (c->cs.tail_mode && c->cs.cursor == off) {
+            // The reply is just this line, send it from memory once it is written
+            submit_log_write(&c->write, c->line, c->line_len, 1);
+            struct io_uring_sqe *sqe = get_sqe();
+            prep_rw(sqe, IORING_OP_SEND, c->slot, c->line, c->line_len, 0);
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = ud(c, OP_SEND);
+            c->inflight += 2;
+            c->cs.cursor = c->reply_end;
+            c->line_reply = 1;
+            c->state = UCONN_REPLYING;
+            return 0;
+        }
+
+        submit_log_write(&c->write, c->line, c->line_len, 0);
+        c->inflight++;
+        c->state = UCONN_WAITING;
+        LIST_INSERT_HEAD(&waiters, c, waiting);
+        return 0;
+    #endif
+}
+
+// Lines process_line() answers itself, matched as it matches them, the rest are appended through the ring
+static int is_command(const char *line, size_t len) {
+    return (len >= SEEKTO_CMD_LEN && strncmp(line, SEEKTO_CMD, SEEKTO_CMD_LEN) == 0) ||
+           (len >= REPLY_CMD_LEN && strncmp(line, REPLY_CMD, REPLY_CMD_LEN) == 0) ||
+           is_stats_cmd(line, len);
+}
+
+/*
+ * Handle buffered lines until one needs I/O, returns -1 if the connection
+ * should be closed.
+ */
+static int conn_advance(struct uconn *c) {
+    // The last line's write is still listed, on_write() resumes us once it is not
+    if (c->write.queued) return 0;
+
+    while (c->state == UCONN_READING && !c->closing) {
+        size_t len;
+        const char *line = framer_next_line(&c->framer, &len);
+
+        if (!line) return c->peer_closed ? -1 : 0;
+        c->line_start_ns = stats_now_ns();
+        stats_line_in(len);
+
+        if (is_command(line, len)) {
+            off_t reply_len;
+            int file_fd = process_line(&c->cs, line, len, &reply_len);
+            if (file_fd == LINE_ERROR) return -1;
+            if (file_fd == LINE_NO_REPLY) {
+                stats_line_done(c->line_start_ns);
+                continue;
+            }
+            c->src_close = 1;
+            int ret = reply_begin(c, file_fd, 0, -1, reply_len);
+            if (ret == -1) return -1;
+            if (ret == 1) reply_done(c);
+            return 0;
+        }
+
+        // Keep a copy, the framer may move its data while the write is in flight
+        if (len > c->line_cap) {
+            char *p = realloc(c->line, len);
+            if (!p) {
+                syslog(LOG_ERR, "Memory allocation failed");
+                return -1;
+            }
+            c->line = p;
+            c->line_cap = len;
+        }
+        memcpy(c->line, line, len);
+        c->line_len = len;
+        if (handle_data_line(c) == -1) return -1;
+    }
+    return 0;
+}
+
+static void on_recv(struct uconn *c, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->inflight--;
+    }
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        size_t got = cqe->res, off = 0;
+
+        while (off < got) {
+            size_t space;
+            char *dst = framer_recv_space(&c->framer, &space);
+            if (!dst) {
+                syslog(LOG_ERR, "Memory allocation failed");
+                c->peer_closed = 1; // Stop reading, close once the buffered lines are done
+                break;
+            }
+            if (space > got - off) space = got - off;
+            memcpy(dst, recv_bufs + (size_t)bid * RECV_BUF_SIZE + off, space);
+            framer_commit(&c->framer, space);
+            off += space;
+        }
+        recv_buf_give(bid);
+    } else if (cqe->res == 0) {
+        c->peer_closed = 1;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        if (cqe->res != -ECONNRESET) syslog(LOG_ERR, "Receive failed: %s", strerror(-cqe->res));
+        conn_close(c);
+        return;
+    }
+
+    if (c->closing) {
+        conn_close(c);
+        return;
+    }
+    // Multishot stops when buffers run out, the buffers come back as clients are served
+    if (!c->recv_armed && !c->peer_closed) arm_recv(c);
+    if (conn_advance(c) == -1) conn_close(c);
+}
+
+static void on_write(struct log_write *w, struct io_uring_cqe *cqe) {
+    if (cqe->res != (int)w->len) {
+        syslog(LOG_ERR, "write failed: %s", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+    }
+    w->done = 1;
+    stats_append_wait(stats_now_ns() - w->submit_ns);
+
+    #if USE_AESD_CHAR_DEVICE
+        struct uconn *c = w->owner; // No timestamps with the driver
+
+        c->inflight--;
+        if (c->closing) conn_close(c);
+    #else
+        // Advance the completely written prefix of the file, the writes leaving
+        // the list are the ones their owners may now reuse or free
+        struct log_write *first;
+        while ((first = TAILQ_FIRST(&writes)) && first->done) {
+            done_end = first->off + first->len;
+            TAILQ_REMOVE(&writes, first, entries);
+            first->queued = 0;
+
+            struct uconn *c = first->owner;
+            if (!c) {
+                ts_busy = 0;
+                continue;
+            }
+            c->inflight--;
+            if (c->closing) conn_close(c);
+            else if (c->state == UCONN_READING && conn_advance(c) == -1) conn_close(c);
+        }
+        wake_waiters();
+    #endif
+}
+
+static void on_read(struct uconn *c, struct io_uring_cqe *cqe) {
+    c->inflight--;
+    c->read_res = cqe->res;
+    if (c->closing) conn_close(c);
+}
+
+static void on_send(struct uconn *c, struct io_uring_cqe *cqe) {
+    c->inflight--;
+    if (c->closing) {
+        conn_close(c);
+        return;
+    }
+
+    if (cqe->res == -ECANCELED) {
+        // The write or read before this send did not complete in full
+        if (c->line_reply || c->read_res == -ECANCELED) {
+            conn_close(c); // Our own line was not written
+        } else if (c->read_res > 0) {
+            struct io_uring_sqe *sqe = get_sqe();
+            prep_rw(sqe, IORING_OP_SEND, c->slot, c->buf, c->read_res, 0);
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = ud(c, OP_SEND);
+            c->inflight++;
+        } else {
+            if (c->read_res < 0) syslog(LOG_ERR, "Reading reply failed: %s", strerror(-c->read_res));
+            reply_done(c); // EOF or read error, like a short file
+        }
+        return;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+            syslog(LOG_ERR, "send failed: %s", strerror(-cqe->res));
+        }
+        conn_close(c);
+        return;
+    }
+
+    stats_bytes_out(cqe->res);
+    if (c->line_reply) {
+        reply_done(c);
+        return;
+    }
+    if (c->src_off >= 0) c->src_off += cqe->res;
+    if (c->src_left > 0) c->src_left -= cqe->res;
+    if (c->src_left == 0) reply_done(c);
+    else reply_chunk(c);
+}
+
+#if !USE_AESD_CHAR_DEVICE
+static void on_timer(void) {
+    // Skip a tick rather than overlap a timestamp still being written
+    if (!ts_busy) {
+        size_t len = format_timestamp(ts_buf, sizeof(ts_buf));
+        ts_write.owner = NULL;
+        submit_log_write(&ts_write, ts_buf, len, 0);
+        ts_busy = 1;
+    }
+    arm_timer();
+}
+#endif
+
+static void on_accept(struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        conn_open(cqe->res);
+    } else if (cqe->res == -ENFILE) {
+        syslog(LOG_WARNING, "All %d io_uring client slots in use", MAX_CLIENTS);
+        accept_paused = 1;
+        return;
+    } else if (cqe->res == -EINVAL || cqe->res == -EBADF || cqe->res == -ENOTSOCK) {
+        syslog(LOG_ERR, "Accept failed: %s", strerror(-cqe->res));
+        ring_failed = 1; // Retrying can not help
+        return;
+    } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+        syslog(LOG_ERR, "Accept failed: %s", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_accept();
+}
+
+static void on_signal(struct io_uring_cqe *cqe) {
+    if (cqe->res != (int)sizeof(signal_info)) {
+        syslog(LOG_ERR, "Reading signals failed: %s", cqe->res < 0 ? strerror(-cqe->res) : "short read");
+        ring_failed = 1;
+        return;
+    }
+    if (signal_info.ssi_signo == SIGUSR1) {
+        arm_signal(); // Nothing to report in this mode
+        return;
+    }
+    caught_signal = signal_info.ssi_signo;
+    shutdown_flag = 1;
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe) {
+    enum uring_op op = cqe->user_data & OP_MASK;
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+    switch (op) {
+        case OP_ACCEPT: on_accept(cqe); break;
+        case OP_SIGNAL: on_signal(cqe); break;
+        case OP_RECV: on_recv(ptr, cqe); break;
+        case OP_WRITE: on_write(ptr, cqe); break;
+        case OP_READ: on_read(ptr, cqe); break;
+        case OP_SEND: on_send(ptr, cqe); break;
+        #if !USE_AESD_CHAR_DEVICE
+        case OP_TIMER: on_timer(); break;
+        #endif
+        default: break;
+    }
+}
+
+static int ring_setup(void) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = CQ_ENTRIES;
+    ring_fd = sys_uring_setup(RING_ENTRIES, &p);
+    if (ring_fd == -1 && errno == EINVAL) {
+        // Older kernel, run completions the traditional way
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+        p.cq_entries = CQ_ENTRIES;
+        ring_fd = sys_uring_setup(RING_ENTRIES, &p);
+    }
+    if (ring_fd == -1) {
+        syslog(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        syslog(LOG_ERR, "io_uring of this kernel is too old");
+        return -1;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map io_uring: %s", strerror(errno));
+        return -1;
+    }
+    sq_head = (unsigned int *)((char *)sq_ring + p.sq_off.head);
+    sq_tail = (unsigned int *)((char *)sq_ring + p.sq_off.tail);
+    sq_mask = (unsigned int *)((char *)sq_ring + p.sq_off.ring_mask);
+    sq_array = (unsigned int *)((char *)sq_ring + p.sq_off.array);
+    cq_head = (unsigned int *)((char *)cq_ring + p.cq_off.head);
+    cq_tail = (unsigned int *)((char *)cq_ring + p.cq_off.tail);
+    cq_mask = (unsigned int *)((char *)cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+    return 0;
+}
+
+// Registered files for the data file and accepted clients
+static int register_files(void) {
+    struct io_uring_rsrc_register reg = { .nr = SLOT_FIRST_CLIENT + MAX_CLIENTS, .flags = IORING_RSRC_REGISTER_SPARSE };
+    struct io_uring_file_index_range range = { .off = SLOT_FIRST_CLIENT, .len = MAX_CLIENTS };
+    int fds[SLOT_FIRST_CLIENT];
+    struct io_uring_rsrc_update update = { .offset = 0, .data = (uint64_t)(uintptr_t)fds };
+    int ret = 0;
+
+    #if USE_AESD_CHAR_DEVICE
+        fds[SLOT_LOG_WRITE] = open(FILE_PATH, O_WRONLY | O_APPEND | O_CLOEXEC);
+    #else
+        // A descriptor of our own, the data log's is O_APPEND which ignores write offsets
+        fds[SLOT_LOG_WRITE] = open(FILE_PATH, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    #endif
+    fds[SLOT_LOG_READ] = open(FILE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fds[SLOT_LOG_WRITE] == -1 || fds[SLOT_LOG_READ] == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", FILE_PATH, strerror(errno));
+        ret = -1;
+    } else if (sys_uring_register(IORING_REGISTER_FILES2, &reg, sizeof(reg)) == -1 ||
+               sys_uring_register(IORING_REGISTER_FILES_UPDATE, &update, SLOT_FIRST_CLIENT) == -1 ||
+               sys_uring_register(IORING_REGISTER_FILE_ALLOC_RANGE, &range, 0) == -1) {
+        syslog(LOG_ERR, "Failed to register files with io_uring: %s", strerror(errno));
+        ret = -1;
+    }
+    // The ring holds its own references now
+    if (fds[SLOT_LOG_WRITE] != -1) close(fds[SLOT_LOG_WRITE]);
+    if (fds[SLOT_LOG_READ] != -1) close(fds[SLOT_LOG_READ]);
+    return ret;
+}
+
+static int register_recv_buffers(void) {
+    size_t ring_size = RECV_BUFS * sizeof(struct io_uring_buf);
+    struct io_uring_buf_reg reg;
+
+    recv_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    recv_bufs = malloc((size_t)RECV_BUFS * RECV_BUF_SIZE);
+    if (recv_ring == MAP_FAILED || !recv_bufs) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)recv_ring;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_GROUP;
+    if (sys_uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        syslog(LOG_ERR, "Failed to register receive buffers: %s", strerror(errno));
+        return -1;
+    }
+    for (unsigned short bid = 0; bid < RECV_BUFS; bid++) {
+        recv_buf_give(bid);
+    }
+    return 0;
+}
+
+static void ring_teardown(void) {
+    // Closing the ring cancels what is still in flight and drops the registered files
+    if (ring_fd != -1) close(ring_fd);
+    if (signal_fd != -1) close(signal_fd);
+    while (!LIST_EMPTY(&conns)) {
+        struct uconn *c = LIST_FIRST(&conns);
+        LIST_REMOVE(c, entries);
+        conn_release(c);
+    }
+    if (sq_ring && sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (cq_ring && cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+    if (sqes && sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (recv_ring && recv_ring != MAP_FAILED) munmap(recv_ring, RECV_BUFS * sizeof(struct io_uring_buf));
+    free(recv_bufs);
+    ring_fd = -1;
+    signal_fd = -1;
+}
+
+/*
+ * Serve clients accepted on server_fd from an io_uring until SIGINT or
+ * SIGTERM, on the calling thread.
+ * Returns 0 after a shutdown request, -1 if the ring could not be set up.
+ */
+int uring_server_run(int server_fd) {
+    sigset_t block_set;
+    int ret = 0;
+
+    listen_fd = server_fd;
+    LIST_INIT(&conns);
+    LIST_INIT(&waiters);
+    TAILQ_INIT(&writes);
+    log_end = done_end = datalog_length();
+
+    // Take the shutdown signals through the ring, so one arriving just
+    // before io_uring_enter() still wakes it
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+    signal_fd = signalfd(-1, &block_set, SFD_CLOEXEC);
+
+    if (signal_fd == -1 || ring_setup() == -1 || register_files() == -1 || register_recv_buffers() == -1) {
+        ring_teardown();
+        pthread_sigmask(SIG_UNBLOCK, &block_set, NULL);
+        return -1;
+    }
+
+    arm_signal();
+    arm_accept();
+    #if !USE_AESD_CHAR_DEVICE
+        arm_timer();
+    #endif
+    syslog(LOG_INFO, "Serving clients from io_uring");
+
+    while (!shutdown_flag && !ring_failed) {
+        // Submit everything prepared and sleep until at least one completion
+        int n = sys_uring_enter(sq_pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EBUSY) {
+                syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+                ret = -1;
+                break;
+            }
+        } else {
+            sq_pending -= n;
+        }
+
+        unsigned int head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            handle_cqe(&cqes[head & *cq_mask]);
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    ring_teardown();
+    pthread_sigmask(SIG_UNBLOCK, &block_set, NULL);
+    return ring_failed ? -1 : ret;
+}
+
+#else
+
+int uring_server_run(int server_fd) {
+    (void)server_fd;
+    syslog(LOG_ERR, "aesdsocket was built without io_uring support (USE_IO_URING=0)");
+    return -1;
+}
+
+#endif
@@ -11,11 +11,13 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
-#include <sys/queue.h> // Singly linked list
+#include <sys/resource.h>
 #include <time.h>
+#include <limits.h>
 
 #include <sys/ioctl.h>
 #include "aesd_ioctl.h"
+#include "aesdsocket.h"
 
 
 #define PORT "9000" // Port number to listen on
@@ -26,19 +28,15 @@
     const char *FILE_PATH = "/var/tmp/aesdsocketdata";
 #endif
 
-// Structure for thread node, used to track active client threads
-typedef struct thread_node {
-    pthread_t thread_id; // Thread ID
-    int client_fd; // Client socket file descriptor
-    SLIST_ENTRY(thread_node) entries; // Linked list entry
-} thread_node_t;
-
 // Global variables
 int server_fd = -1;  // Server socket descriptor
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for file synchronization
-SLIST_HEAD(thread_list, thread_node) head = SLIST_HEAD_INITIALIZER(head); // Singly linked list of threads
 volatile sig_atomic_t shutdown_flag = 0; // Flag to signal shutdown request
+volatile sig_atomic_t caught_signal = 0; // Signal that requested the shutdown
+volatile sig_atomic_t stats_requested = 0; // SIGUSR1 asks for the pool counters in syslog
 pthread_t timestamp_thread; // Thread to append timestamps periodically
+int epoll_mode = 0; // Serve clients from epoll event loops instead of one thread each
+int uring_mode = 0; // Serve clients from an io_uring on the main thread
+int tail_default = 0; // New connections start in incremental (tail) reply mode
 
 
 void daemonize() {
@@ -80,32 +78,83 @@ void daemonize() {
     stderr = fopen("/dev/null", "w");
 }
 
-// Cleanup function to handle SIGINT/SIGTERM
+// Signal handler for SIGINT/SIGTERM, the actual cleanup runs from main()
+void signal_handler(int signum) {
+    if (signum == SIGUSR1) {
+        stats_requested = 1; // Interrupts accept(), main() does the logging
+        return;
+    }
+    caught_signal = signum;
+    shutdown_flag = 1; // Set shutdown flag
+    close(server_fd); // Close server socket so accept() stops
+}
+
+// Cleanup function called once the accept loop has stopped
 void cleanup_and_exit(int signum) {
     syslog(LOG_INFO, "Caught signal %d, exiting", signum);
     shutdown_flag = 1; // Set shutdown flag
-    close(server_fd); // Close server socket
-    
-    // Wait for the timestamp thread to finish execution before exiting
-    pthread_join(timestamp_thread, NULL);
-    
-    // Join all active client threads before exiting to ensure graceful shutdown
-    thread_node_t *node;
-    while (!SLIST_EMPTY(&head)) {
-        node = SLIST_FIRST(&head);
-        pthread_join(node->thread_id, NULL);
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(node);
+
+    #if !USE_AESD_CHAR_DEVICE
+        // Wait for the timestamp thread to finish execution before exiting,
+        // the io_uring mode writes its timestamps from the ring instead
+        if (!uring_mode) pthread_join(timestamp_thread, NULL);
+    #endif
+
+    if (epoll_mode) {
+        epoll_server_stop(); // Closes every connection still owned by the event loops
+    } else if (!uring_mode) {
+        // Wakes the workers, drops clients still queued and joins the workers
+        pool_stop();
+        pool_log_stats();
     }
     #if !USE_AESD_CHAR_DEVICE
          unlink(FILE_PATH); // Remove the temporary file upon exit
     #endif
     
-    pthread_mutex_destroy(&file_mutex); // Destroy the mutex to prevent memory leaks
+    datalog_destroy(); // Destroy the append lock to prevent memory leaks
     closelog(); // Close syslog
     exit(0);
 }
 
+/*
+ * Start a thread with SIGINT/SIGTERM/SIGUSR1 blocked so that the signals are
+ * always delivered to the main thread, which is the one blocked in accept().
+ * Returns 0 on success or the pthread_create() error code.
+ */
+int create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg) {
+    sigset_t block_set, old_set;
+    int ret;
+
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+    ret = pthread_create(thread, NULL, start_routine, arg);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return ret;
+}
+
+// Raise the open file limit to the hard limit, each client needs a descriptor
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            syslog(LOG_WARNING, "Failed to raise open file limit: %s", strerror(errno));
+        }
+    }
+}
+
+// Format the current time as a timestamp line, returns its length
+size_t format_timestamp(char *buf, size_t size) {
+    time_t now = time(NULL);
+    struct tm *tm_info = localtime(&now);
+
+    return strftime(buf, size, "timestamp: %a, %d %b %Y %H:%M:%S %z\n", tm_info);
+}
+
 void *append_timestamp(void *arg) {
     (void)arg;  // Mark argument as unused
 
@@ -116,158 +165,229 @@ void *append_timestamp(void *arg) {
         }
         if (shutdown_flag) break;  // Exit immediately if shutdown is requested
 
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
         char time_str[100];
+        size_t len = format_timestamp(time_str, sizeof(time_str));
 
-        strftime(time_str, sizeof(time_str), "timestamp: %a, %d %b %Y %H:%M:%S %z\n", tm_info);
-
-        // Lock the file to avoid race conditions
-        pthread_mutex_lock(&file_mutex);
-        FILE *file = fopen("/var/tmp/aesdsocketdata", "a");
-        if (file) {
-            fputs(time_str, file);
-            fclose(file);
-        } else {
+        // Goes through the same serialized append as client lines
+        if (datalog_append(time_str, len) == -1) {
             syslog(LOG_ERR, "Failed to open file for timestamp writing");
         }
-        pthread_mutex_unlock(&file_mutex);
     }
     return NULL;
 }
 
 
-void *handle_client(void *arg) {
-    thread_node_t *node = (thread_node_t *)arg;
-    int client_fd = node->client_fd;
-    ssize_t bytes_read;
-    char recv_buffer[1024];
-    char *full_msg = NULL;
-    size_t total_len = 0;
+void client_state_init(struct client_state *cs) {
+    cs->tail_mode = tail_default;
+    cs->cursor = 0;
+    cs->detached_reply = 0;
+}
 
-    while (1) {
-        // Reset message state for each new complete line
-        total_len = 0;
-        free(full_msg);
-        full_msg = NULL;
-
-        //_____Receive until newline is found______
-        while ((bytes_read = recv(client_fd, recv_buffer, sizeof(recv_buffer), 0)) > 0) {
-            char *new_buf = realloc(full_msg, total_len + bytes_read);
-            if (!new_buf) {
-                syslog(LOG_ERR, "Memory allocation failed");
-                free(full_msg);
-                close(client_fd);
-                pthread_exit(NULL);
-            }
-            full_msg = new_buf;
-            memcpy(full_msg + total_len, recv_buffer, bytes_read);
-            total_len += bytes_read;
+/*
+ * Returns 1 if the line is the statistics request, only the command and its
+ * newline, which a line merely starting with it is not
+ */
+int is_stats_cmd(const char *line, size_t len) {
+    return len >= STATS_CMD_LEN && strncmp(line, STATS_CMD, STATS_CMD_LEN) == 0 &&
+           (len == STATS_CMD_LEN || line[STATS_CMD_LEN] == '\n');
+}
 
-            // Check for newline
-            if (memchr(recv_buffer, '\n', bytes_read)) break;
+/*
+ * Handle one complete line received from a client. Normal lines are appended
+ * to FILE_PATH, AESDCHAR_IOCSEEKTO commands seek the device instead and
+ * AESDSOCKET_REPLY:TAIL / AESDSOCKET_REPLY:FULL switch the reply mode of the
+ * connection. In full mode the reply is the whole file, in tail mode only the
+ * data appended since the previous reply on this connection. AESDSTATS is
+ * answered with the server statistics.
+ * Returns a descriptor positioned where the reply starts and stores the number
+ * of bytes to send back in *reply_len (-1 means read until EOF). The caller
+ * passes the descriptor to finish_reply() once the reply has been sent.
+ * Returns LINE_NO_REPLY if nothing should be sent back, or LINE_ERROR if the
+ * connection should be dropped.
+ */
+int process_line(struct client_state *cs, const char *line, size_t len, off_t *reply_len) {
+    int file_fd;
+
+    // --------- HANDLE REPLY MODE NEGOTIATION ----------
+    if (len >= REPLY_CMD_LEN && strncmp(line, REPLY_CMD, REPLY_CMD_LEN) == 0) {
+        const char *mode = line + REPLY_CMD_LEN;
+        size_t mode_len = len - REPLY_CMD_LEN;
+
+        if (mode_len >= 4 && strncmp(mode, "TAIL", 4) == 0) {
+            cs->tail_mode = 1;
+        } else if (mode_len >= 4 && strncmp(mode, "FULL", 4) == 0) {
+            cs->tail_mode = 0;
+        } else {
+            syslog(LOG_ERR, "Malformed reply mode command: %.*s", (int)len, line);
         }
+        return LINE_NO_REPLY; // Not stored in the data file
+    }
 
-        if (bytes_read == -1) {
-            syslog(LOG_ERR, "Receive failed: %s", strerror(errno));
-            break;
-        } else if (bytes_read == 0) {
-            // Client closed connection
-            break;
-        }
-        
-        // --------- HANDLE SPECIAL IOCTL COMMAND ----------
-        if (strncmp(full_msg, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
-            unsigned int write_cmd = 0, write_cmd_offset = 0;
-            if (sscanf(full_msg + 19, "%u,%u", &write_cmd, &write_cmd_offset) == 2) {
-               struct aesd_seekto seekto = {
-                .write_cmd = write_cmd,
-                .write_cmd_offset = write_cmd_offset
-               };
-
-            pthread_mutex_lock(&file_mutex);
-            int file_fd = open(FILE_PATH, O_RDWR);
-            if (file_fd == -1) {
-               syslog(LOG_ERR, "Failed to open device file for ioctl");
-               pthread_mutex_unlock(&file_mutex);
-               break;
-            }
+    // --------- HANDLE STATISTICS REQUEST ----------
+    if (is_stats_cmd(line, len)) {
+        file_fd = stats_report_fd();
+        if (file_fd == -1) return LINE_NO_REPLY;
+        cs->detached_reply = 1;
+        *reply_len = -1;
+        return file_fd;
+    }
 
-            // Perform the ioctl
-            if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
-               syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
-               close(file_fd);
-               pthread_mutex_unlock(&file_mutex);
-               continue; // skip to next message
-            }
-	    memset(recv_buffer, 0, sizeof(recv_buffer));
-            // Read from updated position and send back
-            while ((bytes_read = read(file_fd, recv_buffer, sizeof(recv_buffer))) > 0) {
-               send(client_fd, recv_buffer, bytes_read, 0);
-            }
+    // --------- HANDLE SPECIAL IOCTL COMMAND ----------
+    if (len >= SEEKTO_CMD_LEN && strncmp(line, SEEKTO_CMD, SEEKTO_CMD_LEN) == 0) {
+        char args[32];
+        size_t args_len = len - SEEKTO_CMD_LEN;
+        unsigned int write_cmd = 0, write_cmd_offset = 0;
 
-            lseek(file_fd, 0, SEEK_END);  // Reset position to end for future appends 
-            close(file_fd);
-            free(full_msg);
-            full_msg = NULL;
-            total_len = 0;
-            pthread_mutex_unlock(&file_mutex);
-            
-            continue; // do not fall through to write path
-        
-           } else {
-             syslog(LOG_ERR, "Malformed ioctl command: %s", full_msg);
-             continue;
-           }
+        // The received line is not NUL terminated, parse a bounded copy
+        if (args_len >= sizeof(args)) args_len = sizeof(args) - 1;
+        memcpy(args, line + SEEKTO_CMD_LEN, args_len);
+        args[args_len] = '\0';
+
+        if (sscanf(args, "%u,%u", &write_cmd, &write_cmd_offset) != 2) {
+            syslog(LOG_ERR, "Malformed ioctl command: %.*s", (int)len, line);
+            return LINE_NO_REPLY;
         }
+        struct aesd_seekto seekto = {
+            .write_cmd = write_cmd,
+            .write_cmd_offset = write_cmd_offset
+        };
 
-        // ____Write normal full message to file_____
-        pthread_mutex_lock(&file_mutex);
-        int file_fd = open(FILE_PATH, O_RDWR | O_CREAT | O_APPEND, 0666);
+        // The seek position belongs to this descriptor, no lock needed
+        file_fd = open(FILE_PATH, O_RDWR);
         if (file_fd == -1) {
-            syslog(LOG_ERR, "Failed to open file for writing");
-            pthread_mutex_unlock(&file_mutex);
-            break;
+            syslog(LOG_ERR, "Failed to open device file for ioctl");
+            return LINE_ERROR;
         }
-        ssize_t written = 0;
-        while (written < (ssize_t)total_len) {
-          ssize_t ret = write(file_fd, full_msg + written, total_len - written);
-          if (ret == -1) {
-            syslog(LOG_ERR, "write failed: %s", strerror(errno));
-            break;
-          }
-          written += ret;
+
+        // Perform the ioctl, the reply is read from the updated position
+        if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+            syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+            close(file_fd);
+            return LINE_NO_REPLY; // skip to next message
+        }
+
+        *reply_len = -1;
+        return file_fd; // do not fall through to write path
+    }
+
+    // ____Write normal full message to file_____
+    off_t end = datalog_append(line, len);
+    if (end == -1) return LINE_ERROR;
+
+    // Open for reading, the reply is served without holding any lock
+    file_fd = open(FILE_PATH, O_RDONLY);
+    if (file_fd == -1) {
+        syslog(LOG_ERR, "Failed to open file for reading");
+        return LINE_ERROR;
+    }
+
+    #if USE_AESD_CHAR_DEVICE
+        // The driver bounds the history, read until EOF. Its positions are
+        // relative to the oldest entry it still holds, so the tail cursor is
+        // only exact until the driver starts evicting entries.
+        (void)end;
+        *reply_len = -1;
+        if (cs->tail_mode && lseek(file_fd, cs->cursor, SEEK_SET) == -1) {
+            lseek(file_fd, 0, SEEK_END); // History shrank below the cursor
         }
+    #else
+        // The reply covers the data up to and including this message, later
+        // appends by other clients are left for their own replies
+        off_t start = 0;
+
+        if (cs->tail_mode) start = cs->cursor < end ? cs->cursor : end;
+        lseek(file_fd, start, SEEK_SET);
+        *reply_len = end - start;
+        cs->cursor = end;
+    #endif
+
+    return file_fd;
+}
 
+// Called once the reply read from file_fd has been sent, closes the descriptor
+void finish_reply(struct client_state *cs, int file_fd) {
+    if (cs->detached_reply) {
+        cs->detached_reply = 0;
         close(file_fd);
-        pthread_mutex_unlock(&file_mutex);
+        return;
+    }
+    #if USE_AESD_CHAR_DEVICE
+        // Replies run until EOF, so the final position is where the next tail starts
+        off_t pos = lseek(file_fd, 0, SEEK_CUR);
+        if (pos != -1) cs->cursor = pos;
+    #else
+        (void)cs; // Cursor was advanced to the snapshot length in process_line()
+    #endif
+    close(file_fd);
+}
 
-        // Send back file contents
-        pthread_mutex_lock(&file_mutex);
-        file_fd = open(FILE_PATH, O_RDONLY);
-        if (file_fd == -1) {
-            syslog(LOG_ERR, "Failed to open file for reading");
-            pthread_mutex_unlock(&file_mutex);
+// Serve one client until it disconnects, runs on a pool worker which closes client_fd
+static void serve_client(int client_fd) {
+    ssize_t bytes_read = 0;
+    struct line_framer framer;
+    struct client_state cs;
+    struct reply_stream reply;
+
+    framer_init(&framer);
+    client_state_init(&cs);
+    reply_stream_init(&reply);
+    stats_conn_opened();
+
+    while (1) {
+        const char *line;
+        size_t line_len;
+
+        //_____Receive until a complete line is buffered______
+        while (!(line = framer_next_line(&framer, &line_len))) {
+            size_t space;
+            char *dst = framer_recv_space(&framer, &space);
+            if (!dst) {
+                syslog(LOG_ERR, "Memory allocation failed");
+                break;
+            }
+            bytes_read = recv(client_fd, dst, space, 0);
+            if (bytes_read <= 0) break;
+            framer_commit(&framer, bytes_read);
+        }
+
+        if (!line) {
+            if (bytes_read == -1) {
+                syslog(LOG_ERR, "Receive failed: %s", strerror(errno));
+            }
+            // Client closed connection (or out of memory)
             break;
         }
 
-        while ((bytes_read = read(file_fd, recv_buffer, sizeof(recv_buffer))) > 0) {
-            send(client_fd, recv_buffer, bytes_read, 0);
+        unsigned long long start_ns = stats_now_ns();
+        stats_line_in(line_len);
+
+        off_t reply_len;
+        int file_fd = process_line(&cs, line, line_len, &reply_len);
+        if (file_fd == LINE_ERROR) break;
+        if (file_fd == LINE_NO_REPLY) {
+            stats_line_done(start_ns);
+            continue;
         }
 
-        close(file_fd);
-        pthread_mutex_unlock(&file_mutex);
+        // Send back file contents
+        reply_stream_start(&reply, file_fd, reply_len);
+        int ret = reply_stream_flush(&reply, client_fd);
+        finish_reply(&cs, file_fd);
+        if (ret == -1) break;
+        stats_line_done(start_ns);
     }
 
-    free(full_msg);
-    close(client_fd);
-
-    SLIST_REMOVE(&head, node, thread_node, entries);
-    free(node);
-    pthread_exit(NULL);
+    framer_destroy(&framer);
+    reply_stream_destroy(&reply);
+    stats_conn_closed();
 }
 
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-e|-u] [-i] [-C] [-t num_event_loops] [-g group_window_us] [-f none|batch|interval_ms] [-w num_workers] [-q queue_size] [-S]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[])
  {
  
@@ -280,27 +400,104 @@ int main(int argc, char *argv[])
         printf("File %s does not exist or cannot be deleted.\n", filepath);
     }
  int daemon_mode = 0;
-
-    // Check for -d argument
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
+    int num_loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    // -d: run as daemon, -e: epoll event loop mode, -t: number of event loops,
+    // -i: incremental replies (only new data) unless a client asks for FULL,
+    // -C: copy replies through user space instead of sendfile/splice,
+    // -g: group commit window in microseconds, -f: fsync policy none|batch|<interval ms>,
+    // -w: worker threads, -q: connections that may wait for a worker,
+    // -S: close new connections while the queue is full instead of waiting,
+    // -u: io_uring mode
+    while ((opt = getopt(argc, argv, "deuiCt:g:f:w:q:S")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'e':
+                epoll_mode = 1;
+                stats_backend = "epoll";
+                break;
+            case 'u':
+                uring_mode = 1;
+                stats_backend = "io_uring";
+                break;
+            case 'i':
+                tail_default = 1;
+                break;
+            case 'C':
+                zero_copy_disabled = 1;
+                break;
+            case 't':
+                num_loops = atoi(optarg);
+                break;
+            case 'g':
+                datalog_config.group_window_us = atoi(optarg);
+                if (datalog_config.group_window_us < 0) datalog_config.group_window_us = 0;
+                if (datalog_config.group_window_us > 999999) datalog_config.group_window_us = 999999;
+                break;
+            case 'f':
+                if (strcmp(optarg, "none") == 0) {
+                    datalog_config.sync = DATALOG_SYNC_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    datalog_config.sync = DATALOG_SYNC_BATCH;
+                } else {
+                    char *end;
+                    errno = 0;
+                    long ms = strtol(optarg, &end, 10);
+                    if (errno || end == optarg || *end != '\0' || ms < 1 || ms > INT_MAX) {
+                        fprintf(stderr, "Invalid fsync interval %s, expected milliseconds from 1 on\n", optarg);
+                        usage(argv[0]);
+                    }
+                    datalog_config.sync = DATALOG_SYNC_INTERVAL;
+                    datalog_config.sync_interval_ms = (int)ms;
+                }
+                break;
+            case 'w':
+                pool_config.workers = atoi(optarg);
+                if (pool_config.workers < 1) pool_config.workers = 1;
+                break;
+            case 'q':
+                pool_config.queue_size = atoi(optarg);
+                if (pool_config.queue_size < 1) pool_config.queue_size = 1;
+                break;
+            case 'S':
+                pool_config.shed = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_loops < 1) num_loops = 1;
+    if (uring_mode && epoll_mode) {
+        fprintf(stderr, "-e and -u are mutually exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+    // The event loops append inline, a group commit window would stall every connection of a loop
+    if (epoll_mode && datalog_config.group_window_us > 0) {
+        fprintf(stderr, "-g cannot be used with -e\n");
+        exit(EXIT_FAILURE);
     }
 
     struct addrinfo hints, *res;
     struct sockaddr_storage client_addr;
     socklen_t client_addr_len;
-    thread_node_t *node;
 
     // Open syslog for logging messages
     openlog("aesdsocket", LOG_PID, LOG_USER);
 
     // Setup signal handlers for graceful termination
     struct sigaction sa;
-    sa.sa_handler = cleanup_and_exit;
+    sa.sa_handler = signal_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // sendfile()/splice() to a closed socket raise SIGPIPE, report it as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
     // Configure server address
     memset(&hints, 0, sizeof(hints));
@@ -333,44 +530,72 @@ int main(int argc, char *argv[])
     if (daemon_mode) {
         daemonize();
     }
-    pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+    // Initialize the data log before starting any thread
+    datalog_init(FILE_PATH);
+    stats_init();
 
-// Initialize mutex before starting any thread
-pthread_mutex_init(&file_mutex, NULL);
-    
     #if !USE_AESD_CHAR_DEVICE
         // Create and start the timestamp thread
-        pthread_create(&timestamp_thread, NULL, append_timestamp, NULL);
+        if (!uring_mode && create_thread(&timestamp_thread, append_timestamp, NULL) != 0) {
+            syslog(LOG_ERR, "Failed to create timestamp thread");
+            exit(EXIT_FAILURE);
+        }
     #endif
 
-    // Start listening for incoming client connections
-    if (listen(server_fd, BACKLOG) == -1) {
+    if (epoll_mode) {
+        raise_fd_limit();
+        if (epoll_server_start(num_loops) == -1) {
+            syslog(LOG_ERR, "Failed to start epoll event loops");
+            exit(EXIT_FAILURE);
+        }
+    } else if (!uring_mode && pool_start(serve_client) == -1) {
+        syslog(LOG_ERR, "Failed to start worker pool");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start listening for incoming client connections, the event loops can
+    // keep thousands of clients so let the kernel queue more pending ones
+    if (listen(server_fd, epoll_mode || uring_mode ? SOMAXCONN : BACKLOG) == -1) {
         syslog(LOG_ERR, "Listen failed");
         close(server_fd);
         exit(EXIT_FAILURE);
     }
 
+    if (uring_mode) {
+        // Accepts and serves everything from the ring until a shutdown signal
+        if (uring_server_run(server_fd) == -1) {
+            syslog(LOG_ERR, "Failed to run io_uring server");
+            exit(EXIT_FAILURE);
+        }
+        cleanup_and_exit(caught_signal);
+    }
+
     while (!shutdown_flag) {
         client_addr_len = sizeof(client_addr);
         int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_fd == -1) {
             if (shutdown_flag) break;
+            if (errno == EINTR) {
+                if (stats_requested && !epoll_mode) pool_log_stats();
+                stats_requested = 0;
+                continue;
+            }
             syslog(LOG_ERR, "Accept failed");
             continue;
         }
 
-        node = malloc(sizeof(thread_node_t));
-        if (!node) {
-            syslog(LOG_ERR, "Memory allocation failed");
-            close(client_fd);
+        if (epoll_mode) {
+            // Hand the connection over to one of the event loops
+            if (epoll_server_add_client(client_fd) == -1) {
+                syslog(LOG_ERR, "Failed to hand client to event loop");
+                close(client_fd);
+            }
             continue;
         }
-        node->client_fd = client_fd;
-
-        SLIST_INSERT_HEAD(&head, node, entries);
 
-        pthread_create(&node->thread_id, NULL, handle_client, node);
+        // Waits for a free queue slot or sheds the connection when the queue is full
+        pool_submit(client_fd);
     }
 
-    cleanup_and_exit(0);
+    cleanup_and_exit(caught_signal);
 }
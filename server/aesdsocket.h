@@ -0,0 +1,151 @@
+/*
+ * aesdsocket.h
+ *
+ * Declarations shared between the aesdsocket main program and its
+ * alternate server backends.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define SEEKTO_CMD "AESDCHAR_IOCSEEKTO:" // Special command prefix handled by the server
+#define SEEKTO_CMD_LEN (sizeof(SEEKTO_CMD) - 1)
+
+#define REPLY_CMD "AESDSOCKET_REPLY:" // Per connection reply mode negotiation
+#define REPLY_CMD_LEN (sizeof(REPLY_CMD) - 1)
+
+#define STATS_CMD "AESDSTATS" // Reply with the server statistics instead of the data
+#define STATS_CMD_LEN (sizeof(STATS_CMD) - 1)
+
+// process_line() results other than a reply descriptor
+#define LINE_NO_REPLY (-1) // Nothing to send back, keep reading
+#define LINE_ERROR (-2)    // Drop the connection
+
+// Protocol state kept for each client connection
+struct client_state {
+    int tail_mode; // Reply only with the data appended since the previous reply
+    off_t cursor;  // Data position the previous reply ended at
+    int detached_reply; // Current reply is not read from the data, leave the cursor alone
+};
+
+enum reply_method {
+    REPLY_SENDFILE, // Regular file straight to the socket
+    REPLY_SPLICE,   // Device through a pipe to the socket
+    REPLY_COPY      // read()/send() through a user space buffer
+};
+
+// A reply being streamed from the data file to a client socket
+struct reply_stream {
+    int file_fd;        // Source descriptor, -1 when no reply is in progress
+    off_t left;         // Bytes still to take from the source, -1 means until EOF
+    enum reply_method method;
+    size_t pending;     // Bytes staged in the pipe or buffer but not yet sent
+    int pipe_fd[2];     // Splice staging pipe, created on first use
+    size_t pipe_size;
+    char *buf;          // Copy staging buffer, allocated on first use
+    size_t buf_off;
+};
+
+// Splits received bytes into lines, one per connection
+struct line_framer {
+    char *buf;
+    size_t cap;
+    size_t start;   // First byte not yet returned as part of a line
+    size_t end;     // End of the received data
+    size_t scanned; // Bytes after start already searched for a newline
+};
+
+extern const char *FILE_PATH;
+extern volatile sig_atomic_t shutdown_flag;
+extern volatile sig_atomic_t caught_signal;
+
+// aesdsocket.c
+int create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg);
+void client_state_init(struct client_state *cs);
+int is_stats_cmd(const char *line, size_t len);
+int process_line(struct client_state *cs, const char *line, size_t len, off_t *reply_len);
+void finish_reply(struct client_state *cs, int file_fd);
+size_t format_timestamp(char *buf, size_t size);
+
+// aesdsocket-datalog.c
+enum datalog_sync {
+    DATALOG_SYNC_NONE,    // Leave write back to the kernel
+    DATALOG_SYNC_BATCH,   // fdatasync() after every group commit
+    DATALOG_SYNC_INTERVAL // fdatasync() every sync_interval_ms while new data comes in
+};
+
+struct datalog_config {
+    int group_window_us; // How long a commit leader waits for more appends
+    enum datalog_sync sync;
+    int sync_interval_ms;
+};
+
+extern struct datalog_config datalog_config;
+void datalog_init(const char *path);
+void datalog_destroy(void);
+off_t datalog_append(const char *buf, size_t len);
+off_t datalog_length(void);
+
+// aesdsocket-reply.c
+extern int zero_copy_disabled;
+void reply_stream_init(struct reply_stream *r);
+void reply_stream_destroy(struct reply_stream *r);
+void reply_stream_start(struct reply_stream *r, int file_fd, off_t len);
+int reply_stream_flush(struct reply_stream *r, int client_fd);
+
+// aesdsocket-framer.c
+void framer_init(struct line_framer *f);
+void framer_destroy(struct line_framer *f);
+char *framer_recv_space(struct line_framer *f, size_t *space);
+void framer_commit(struct line_framer *f, size_t n);
+const char *framer_next_line(struct line_framer *f, size_t *len);
+
+// aesdsocket-pool.c
+struct pool_config {
+    int workers;    // Worker threads serving clients
+    int queue_size; // Accepted sockets that may wait for a worker, rounded up to a power of two
+    int shed;       // Close new connections when the queue is full instead of waiting
+};
+
+struct pool_stats {
+    unsigned long long accepted;    // Sockets queued for the workers
+    unsigned long long shed;        // Sockets closed because the queue was full
+    unsigned long long served;      // Clients served to completion
+    unsigned long long wait_ns;     // Total time sockets spent queued
+    unsigned long long wait_max_ns;
+    int depth;                      // Sockets queued right now
+    int depth_max;
+};
+
+extern struct pool_config pool_config;
+int pool_start(void (*serve)(int client_fd));
+int pool_submit(int client_fd);
+void pool_get_stats(struct pool_stats *stats);
+void pool_log_stats(void);
+void pool_stop(void);
+
+// aesdsocket-stats.c
+extern const char *stats_backend;
+void stats_init(void);
+unsigned long long stats_now_ns(void);
+void stats_conn_opened(void);
+void stats_conn_closed(void);
+void stats_line_in(size_t len);
+void stats_bytes_out(size_t len);
+void stats_line_done(unsigned long long start_ns);
+void stats_append_wait(unsigned long long ns);
+int stats_report_fd(void);
+
+// aesdsocket-uring.c
+int uring_server_run(int server_fd);
+
+// aesdsocket-epoll.c
+int epoll_server_start(int nloops);
+int epoll_server_add_client(int client_fd);
+void epoll_server_stop(void);
+
+#endif /* AESDSOCKET_H */